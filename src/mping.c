@@ -9,6 +9,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +19,7 @@
 #include <unistd.h>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/types.h>
@@ -31,6 +34,8 @@
 
 #include <asyncns.h>
 
+#include "mping_ring.h"
+
 #ifndef SIOCGSTAMPNS
 #include <linux/sockios.h>
 #endif
@@ -47,15 +52,232 @@ struct ping_addr {
   socklen_t addrlen;
 };
 
-struct ping_info {
-  struct timespec time_sent;
-  struct timespec time_recv;
-  int count_recv;
-  struct ping_addr daddr_send;
-  struct ping_addr saddr_recv;
-  int id;
-  int seq;
-  asyncns_query_t *asyncns_name_query;
+// 宛先毎の送受信状態
+enum ping_slot_state {
+  PING_SLOT_IDLE = 0,
+  PING_SLOT_SENT,
+  PING_SLOT_RECV,
+  PING_SLOT_TIMEOUT,
+};
+
+// 応答処理で参照する宛先毎の情報 (ホットデータ, 16 byte)
+// 応答の id/seq から直接添字を求めて参照する
+struct ping_slot {
+  uint64_t time_ns; // SENT: 送信時刻, RECV: RTT
+  uint32_t nonce;
+  uint16_t count_recv;
+  uint8_t state;
+  uint8_t printed : 1;
+  uint8_t tries : 3;
+};
+
+// 宛先アドレス (コールドデータ)
+// IPv4 の宛先は IPv6 分の領域を消費しない
+#define PING_ADDRREF_INET6 0x80000000u
+
+struct ping_addr6 {
+  struct in6_addr addr;
+  uint32_t scope_id;
+};
+
+struct ping_addrtab {
+  uint32_t *ref; // 宛先毎: PING_ADDRREF_INET6 | addr4/addr6 の添字
+  struct in_addr *addr4;
+  size_t addr4len;
+  size_t addr4cap;
+  struct ping_addr6 *addr6;
+  size_t addr6len;
+  size_t addr6cap;
+};
+
+// 適応送信制御 (-A)
+// 応答率と損失率を宛先プレフィクス毎および全体で追跡し AIMD で送信率を決める
+#define PING_ADAPT_RETRIES 2
+#define PING_ADAPT_LOSS_THRESHOLD 0.1
+#define PING_ADAPT_LOSS_DARK 0.9
+#define PING_ADAPT_LOSS_WEIGHT (1.0 / 16)
+#define PING_ADAPT_RATE_MIN 1.0
+#define PING_ADAPT_PREFIX4 24
+#define PING_ADAPT_PREFIX6 48
+#define PING_ADAPT_NONE UINT32_MAX
+
+struct ping_rate {
+  double rate; // 送信率 (pps)
+  double ceil; // 送信率の上限 (pps)
+  double loss; // 損失率 (指数移動平均)
+  uint64_t backoff_ns; // 最後に減速した時刻 (0: 未減速)
+};
+
+struct ping_prefix {
+  uint64_t key;
+  uint64_t next_ns; // 次に送信可能な時刻
+  struct ping_rate rate;
+  uint32_t head; // 送信待ちの宛先
+  uint32_t tail;
+  uint32_t nrecv;
+  uint8_t queued;
+};
+
+struct ping_adapt {
+  struct ping_rate rate;
+  double armed_rate;
+  struct ping_prefix *prefix;
+  size_t prefixlen;
+  size_t prefixcap;
+  uint32_t *hash; // プレフィクスの添字 (PING_ADAPT_NONE: 空)
+  size_t hashcap;
+  uint32_t *heap; // next_ns 順の送信待ちプレフィクス
+  size_t heaplen;
+  uint32_t *prefix_of; // 宛先毎のプレフィクス
+  uint32_t *next;      // 宛先毎の送信待ちリスト
+  uint32_t *inflight;  // 送信順の応答待ち宛先 (リングバッファ)
+  size_t inflight_head;
+  size_t inflight_len;
+  size_t npending;
+};
+
+// 受信した ICMP の種別
+enum ping_reply_kind {
+  PING_REPLY_ECHO = 0,
+  PING_REPLY_TIMXCEED,
+  PING_REPLY_UNREACH,
+  PING_REPLY_TOOBIG,
+};
+
+struct ping_reply {
+  struct ping_addr saddr;
+  uint64_t time_ns;
+  uint32_t tag; // 要求の id/seq
+  uint32_t mtu;
+  uint8_t kind;
+  uint8_t code;
+  uint8_t src; // 受信した送信元
+};
+
+// 経路探索 (-T)
+// 全宛先の全ホップを並行に送信し, 宛先毎に maxttl 個のホップ情報を持つ
+struct ping_hop {
+  uint64_t time_ns; // SENT: 送信時刻, RECV: RTT
+  uint8_t state;
+  uint8_t kind;
+  uint8_t code;
+};
+
+struct ping_trace {
+  int maxttl;
+  struct ping_hop *hop;
+  struct ping_addrtab hopaddr; // ホップ毎の応答元
+  uint8_t *reach;              // 宛先毎の到達した TTL (0: 未到達)
+};
+
+// 経路 MTU 探索 (-M)
+// 宛先毎に DF 付きの要求の大きさ (IP ヘッダを含む) を二分探索する
+#define PING_PMTU_MIN4 68
+#define PING_PMTU_MIN6 1280
+#define PING_PMTU_MAX 65535
+#define PING_PMTU_RETRIES 2 // 応答のない大きさを再送する回数
+
+struct ping_pmtu {
+  uint16_t lo;   // 通過が確認された (または規格上保証された) 大きさ
+  uint16_t hi;   // 候補の上限
+  uint16_t size; // 送信中の大きさ
+  uint8_t probe_hi : 1; // 次は上限を送る
+};
+
+// 送信元 (-I, -S)
+// 送信元毎にソケットを持ち, 宛先をいずれかの送信元に割り当てる
+#define PING_SOURCE_MAX 64
+
+enum ping_source_type {
+  PING_SOURCE_DEFAULT = 0,
+  PING_SOURCE_IFACE,
+  PING_SOURCE_ADDR,
+};
+
+struct ping_source {
+  uint8_t type;
+  const char *name;
+  int sock4;
+  int sock6;
+};
+
+// 状態変化の出力 (-C)
+// 宛先毎に 2 byte の状態を持ち, 状態が変化した宛先だけを出力する
+enum ping_mon_state {
+  PING_MON_UNKNOWN = 0,
+  PING_MON_UP,
+  PING_MON_DOWN,
+};
+
+enum ping_mon_band {
+  PING_MON_NORMAL = 0,
+  PING_MON_LOW,
+  PING_MON_HIGH,
+};
+
+enum ping_mon_event {
+  PING_MON_EV_NONE = 0,
+  PING_MON_EV_UP,
+  PING_MON_EV_DOWN,
+  PING_MON_EV_NORMAL,
+  PING_MON_EV_LOW,
+  PING_MON_EV_HIGH,
+};
+
+static const char *const ping_mon_event_name[] = {
+    "none", "up", "down", "rtt-normal", "rtt-low", "rtt-high",
+};
+
+struct ping_mon {
+  uint8_t state : 2;
+  uint8_t band : 2;
+  uint8_t event : 3; // 出力待ちの事象
+  uint8_t misses;    // 連続した無応答の回数
+};
+
+// エコー要求のヘッダ
+// ICMP と ICMPv6 で配置が同じ (type, code, checksum, id, seq)
+union ping_echo_hdr {
+  struct icmphdr icmphdr;
+  struct icmp6_hdr icmp6_hdr;
+};
+
+// 送信の雛形 (送信元とアドレスファミリ毎)
+// ヘッダは id/seq を 0 としてチェックサムまで計算しておく
+struct ping_tmpl {
+  union ping_echo_hdr hdr;
+  struct iovec iov[2]; // ヘッダ, 共有のペイロード
+  struct msghdr msg;
+  int sock;
+};
+
+// 一度の sendmmsg で送る要求の最大数
+#define PING_BATCH_MAX 64
+
+// まとめて送る要求
+// 宛先毎に変わるヘッダと宛先アドレスは送信時にここへ組み立てる
+struct ping_batch {
+  struct mmsghdr msg[PING_BATCH_MAX];
+  struct iovec iov[PING_BATCH_MAX][2];
+  struct ping_addr daddr[PING_BATCH_MAX];
+  union ping_echo_hdr hdr[PING_BATCH_MAX];
+  uint32_t idx[PING_BATCH_MAX];
+  int sock[PING_BATCH_MAX];
+  size_t len;
+  size_t max;
+};
+
+// 精密計測 (-L)
+#define PING_BUSY_POLL_US 50
+#define PING_CALIB_COUNT 1000
+#define PING_CALIB_TIMEOUT_NS 10000000   // 1 回の応答待ち
+#define PING_CALIB_DEADLINE_NS 1000000000 // 較正全体の期限
+
+// 名前の展開 (-F)
+enum ping_fanout {
+  PING_FANOUT_NONE = 0, // 最初のアドレスのみ
+  PING_FANOUT_ALL,      // 全てのアドレス
+  PING_FANOUT_FAMILY,   // アドレスファミリ毎に最初のアドレス
 };
 
 static struct timespec ntots(long sec, long nsec) {
@@ -67,6 +289,12 @@ static struct timespec ntots(long sec, long nsec) {
 #define PINGOPT_DATALEN_DEFAULT (64 - sizeof(struct icmphdr))
 #define PINGOPT_INTERVAL_DEFAULT (ntots(1, 0))
 #define PINGOPT_TIMEOUT_DEFAULT (ntots(0, 10000000))
+#define PINGOPT_RATE_DEFAULT 10000.0
+#define PINGOPT_PREFIX_RATE_DEFAULT 100.0
+#define PINGOPT_COUNT_DEFAULT 1
+#define PINGOPT_PERIOD_DEFAULT (ntots(1, 0))
+#define PINGOPT_MISSES_DEFAULT 3
+#define PINGOPT_HEARTBEAT_DEFAULT 60
 
 struct ping_option {
   unsigned ipv4 : 1;
@@ -77,22 +305,59 @@ struct ping_option {
   unsigned int datalen : 16;
   unsigned int verbose : 3;
   unsigned pstderr : 1;
+  unsigned adaptive : 1;
+  unsigned trace : 1;
+  unsigned pmtu : 1;
+  unsigned srchash : 1;
+  unsigned nsrc : 7;
+  unsigned changes : 1;
+  unsigned precision : 1;
+  unsigned fanout : 2;
   char *data;
   struct timespec interval;
   struct timespec timeout;
+  double rate;
+  double prefix_rate;
+  struct ping_source src[PING_SOURCE_MAX];
+  unsigned long count; // 周回数 (0: 無限)
+  struct timespec period;
+  uint8_t misses;
+  unsigned long heartbeat;
+  uint64_t rtt_low_ns;
+  uint64_t rtt_high_ns;
+  const char *ring_path;
+  uint32_t ring_capacity;
+  int cpu;
 };
 
 struct ping_context {
-  int sock4;
-  int sock6;
+  struct ping_source src[PING_SOURCE_MAX];
+  int nsrc;
+  uint8_t *srcof; // 宛先毎の送信元 (送信元が 1 つなら NULL)
   asyncns_t *asyncns;
   int asyncnsfd;
   int timeoutfd;
   int intervalfd;
-  int id;
-  struct ping_info *info;
-  size_t infolen;
-  int sndidx;
+  uint32_t key;
+  uint32_t nonce_mod;
+  struct ping_slot *slot;
+  struct ping_addrtab addrtab;
+  size_t slotlen;
+  size_t slotcap;
+  size_t sndidx;
+  size_t nprinted;
+  struct ping_adapt *adapt;
+  struct ping_trace *trace;
+  struct ping_pmtu *pmtu;
+  struct ping_mon *mon;
+  struct mping_ring *ring;
+  uint32_t *nameof; // -F: 宛先毎の名前の番号
+  char **names;
+  struct ping_tmpl *tmpl; // [送信元 * 2 + (IPv6 なら 1)]
+  struct ping_batch *batch;
+  unsigned long round;
+  uint64_t round_start_ns;
+  int round_pending;
   struct ping_option opt;
 };
 
@@ -103,131 +368,1002 @@ unsigned short checksum(struct iovec *iov, size_t iovlen) {
 
   for (int i = 0; i < iovlen; i++)
     for (int j = 0; j < iov[i].iov_len; j++)
-      sum += ((char *)iov[i].iov_base)[j] << (8 * (k++ & 1));
+      sum += ((unsigned char *)iov[i].iov_base)[j] << (8 * (k++ & 1));
   sum = (sum & 65535) + (sum >> 16);
   sum = (sum & 65535) + (sum >> 16);
   return ~sum;
 }
 
-static int icmp_setopt(struct ping_context *ctx) {
+static int icmp_setopt(const struct ping_option *po, int sock4, int sock6) {
   int ret = 0;
 
 #if 0
   {
     int flag = 0;
     ret =
-      setsockopt (ctx->sock4, IPPROTO_IP, IP_HDRINCL, &flag, sizeof (flag));
+      setsockopt (sock4, IPPROTO_IP, IP_HDRINCL, &flag, sizeof (flag));
     if (ret != 0)
       return ret;
   }
 #endif
-  if (ctx->opt.ttl >= 0) {
-    int ttl = ctx->opt.ttl;
+  if (po->ttl >= 0) {
+    int ttl = po->ttl;
 
-    ret = setsockopt(ctx->sock4, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
-    if (ret != 0)
-      return ret;
-    if (ctx->opt.ipv6) {
-      ttl = ctx->opt.ttl;
+    if (sock4 != -1) {
+      ret = setsockopt(sock4, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+      if (ret != 0)
+        return ret;
+    }
+    if (po->ipv6 && sock6 != -1) {
+      ttl = po->ttl;
 
-      ret = setsockopt(ctx->sock6, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl,
+      ret = setsockopt(sock6, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl,
                        sizeof(ttl));
       if (ret != 0)
         return ret;
     }
   }
-  {
-    int flags = fcntl(ctx->sock4, F_GETFL);
+  if (po->pmtu) {
+    int val = IP_PMTUDISC_PROBE;
+
+    if (sock4 != -1) {
+      ret = setsockopt(sock4, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+      if (ret != 0)
+        return ret;
+    }
+    if (sock6 != -1) {
+      val = IPV6_PMTUDISC_PROBE;
+      ret = setsockopt(sock6, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val,
+                       sizeof(val));
+      if (ret != 0)
+        return ret;
+      val = 1;
+      ret = setsockopt(sock6, IPPROTO_IPV6, IPV6_DONTFRAG, &val, sizeof(val));
+      if (ret != 0)
+        return ret;
+    }
+  }
+  if (po->precision) {
+    int val = PING_BUSY_POLL_US;
+
+    // 権限が足りなければ通常の受信のまま続ける
+    if (sock4 != -1 &&
+        setsockopt(sock4, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) != 0)
+      syslog(LOG_WARNING, "setsockopt(SO_BUSY_POLL): %s", strerror(errno));
+    if (sock6 != -1 &&
+        setsockopt(sock6, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) != 0)
+      syslog(LOG_WARNING, "setsockopt(SO_BUSY_POLL): %s", strerror(errno));
+  }
+  if (sock4 != -1) {
+    int flags = fcntl(sock4, F_GETFL);
     flags |= O_NONBLOCK;
-    fcntl(ctx->sock4, F_SETFL, &flags);
+    fcntl(sock4, F_SETFL, flags);
   }
-  {
-    int flags = fcntl(ctx->sock6, F_GETFL);
+  if (sock6 != -1) {
+    int flags = fcntl(sock6, F_GETFL);
     flags |= O_NONBLOCK;
-    fcntl(ctx->sock6, F_SETFL, &flags);
+    fcntl(sock6, F_SETFL, flags);
   }
   return ret;
 }
 
-static ssize_t icmp_echo_send(struct ping_context *ctx) {
-  struct msghdr msghdr;
-  struct iovec iov[2];
-  struct ping_info *pi;
-  ssize_t ret;
-  struct icmphdr icmphdr;
-  struct icmp6_hdr icmp6_hdr;
-
-  // 送信情報の組み立て
-  pi = ctx->info + ctx->sndidx;
-
-  pi->id = ctx->id;
-  pi->seq = 0;
+static uint64_t timespec_to_ns(struct timespec ts) {
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  // ヘッダ情報
-  switch (pi->daddr_send.addr.sa_family) {
+// 宛先アドレスの登録
+static int ping_addrtab_add(struct ping_addrtab *at, size_t idx,
+                            const struct sockaddr *saddr) {
+  switch (saddr->sa_family) {
   case AF_INET:
-    icmphdr.type = ICMP_ECHO;
-    icmphdr.code = 0;
-    icmphdr.checksum = 0;
-    icmphdr.un.echo.id = htons(pi->id);
-    icmphdr.un.echo.sequence = htons(pi->seq);
-
-    // 送信情報の作成
-    iov[0].iov_base = &icmphdr;
-    iov[0].iov_len = sizeof(icmphdr);
-    iov[1].iov_base = ctx->opt.data;
-    iov[1].iov_len = ctx->opt.datalen;
-    // チェックサムの計算
-    icmphdr.checksum = checksum(iov, 2);
+    if (at->addr4len >= at->addr4cap) {
+      size_t cap = at->addr4cap ? at->addr4cap * 2 : 16;
+      struct in_addr *addr4 = realloc(at->addr4, sizeof(*addr4) * cap);
+
+      if (addr4 == NULL)
+        return -1;
+      at->addr4 = addr4;
+      at->addr4cap = cap;
+    }
+    at->addr4[at->addr4len] = ((const struct sockaddr_in *)saddr)->sin_addr;
+    at->ref[idx] = at->addr4len++;
+    return 0;
 
-    break;
   case AF_INET6:
-    icmp6_hdr.icmp6_type = ICMP6_ECHO_REQUEST;
-    icmp6_hdr.icmp6_code = 0;
-    icmp6_hdr.icmp6_cksum = 0;
-    icmp6_hdr.icmp6_id = htons(pi->id);
-    icmp6_hdr.icmp6_seq = htons(pi->seq);
-
-    // 送信情報の作成
-    iov[0].iov_base = &icmp6_hdr;
-    iov[0].iov_len = sizeof(icmp6_hdr);
-    iov[1].iov_base = ctx->opt.data;
-    iov[1].iov_len = ctx->opt.datalen;
-    // チェックサムの計算
-    icmp6_hdr.icmp6_cksum = checksum(iov, 2);
+    if (at->addr6len >= at->addr6cap) {
+      size_t cap = at->addr6cap ? at->addr6cap * 2 : 16;
+      struct ping_addr6 *addr6 = realloc(at->addr6, sizeof(*addr6) * cap);
 
-    break;
+      if (addr6 == NULL)
+        return -1;
+      at->addr6 = addr6;
+      at->addr6cap = cap;
+    }
+    at->addr6[at->addr6len].addr =
+        ((const struct sockaddr_in6 *)saddr)->sin6_addr;
+    at->addr6[at->addr6len].scope_id =
+        ((const struct sockaddr_in6 *)saddr)->sin6_scope_id;
+    at->ref[idx] = PING_ADDRREF_INET6 | at->addr6len++;
+    return 0;
+  }
+  errno = EAFNOSUPPORT;
+  return -1;
+}
+
+// 宛先アドレスの取得
+static void ping_addrtab_get(const struct ping_addrtab *at, size_t idx,
+                             struct ping_addr *pa) {
+  uint32_t ref = at->ref[idx];
+
+  memset(pa, 0, sizeof(*pa));
+  if (ref & PING_ADDRREF_INET6) {
+    const struct ping_addr6 *addr6 = at->addr6 + (ref & ~PING_ADDRREF_INET6);
+
+    pa->addr6.sin6_family = AF_INET6;
+    pa->addr6.sin6_addr = addr6->addr;
+    pa->addr6.sin6_scope_id = addr6->scope_id;
+    pa->addrlen = sizeof(pa->addr6);
+  } else {
+    pa->addr4.sin_family = AF_INET;
+    pa->addr4.sin_addr = at->addr4[ref];
+    pa->addrlen = sizeof(pa->addr4);
   }
-  msghdr.msg_name = &pi->daddr_send.addr;
-  msghdr.msg_namelen = pi->daddr_send.addrlen;
+}
+
+static void ping_addrtab_free(struct ping_addrtab *at) {
+  free(at->ref);
+  free(at->addr4);
+  free(at->addr6);
+  memset(at, 0, sizeof(*at));
+}
+
+// 宛先添字と nonce を ICMP の id/seq (32bit) に符号化する
+static uint32_t ping_tag_encode(const struct ping_context *ctx, size_t idx,
+                                uint32_t nonce) {
+  return ctx->key + nonce * (uint32_t)ctx->slotlen + (uint32_t)idx;
+}
+
+// id/seq から宛先添字と nonce を復号する
+static ssize_t ping_tag_decode(const struct ping_context *ctx, uint32_t tag,
+                               uint32_t *nonce) {
+  uint32_t t = tag - ctx->key;
+
+  if (ctx->slotlen == 0 || t / ctx->slotlen >= ctx->nonce_mod)
+    return -1;
+  *nonce = t / ctx->slotlen;
+  return t % ctx->slotlen;
+}
+
+// 適応送信制御: プレフィクスの算出
+static uint64_t ping_prefix_key(const struct ping_addrtab *at, size_t idx) {
+  uint32_t ref = at->ref[idx];
+  uint64_t key = 0;
+
+  if (ref & PING_ADDRREF_INET6) {
+    const uint8_t *addr = at->addr6[ref & ~PING_ADDRREF_INET6].addr.s6_addr;
+
+    for (int i = 0; i < PING_ADAPT_PREFIX6 / 8; i++)
+      key = key << 8 | addr[i];
+    return key | (uint64_t)1 << 63;
+  }
+  return ntohl(at->addr4[ref].s_addr) >> (32 - PING_ADAPT_PREFIX4);
+}
+
+static size_t ping_prefix_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+// プレフィクスの検索と登録
+static ssize_t ping_adapt_prefix(struct ping_adapt *ad, uint64_t key,
+                                 const struct ping_option *po) {
+  struct ping_prefix *pp;
+  size_t mask, i;
+
+  if (ad->prefixlen * 2 >= ad->hashcap) {
+    size_t cap = ad->hashcap ? ad->hashcap * 2 : 64;
+    uint32_t *hash = malloc(sizeof(*hash) * cap);
+
+    if (hash == NULL)
+      return -1;
+    memset(hash, 0xff, sizeof(*hash) * cap);
+    for (size_t j = 0; j < ad->prefixlen; j++) {
+      for (i = ping_prefix_hash(ad->prefix[j].key) & (cap - 1);
+           hash[i] != PING_ADAPT_NONE; i = (i + 1) & (cap - 1))
+        ;
+      hash[i] = j;
+    }
+    free(ad->hash);
+    ad->hash = hash;
+    ad->hashcap = cap;
+  }
+  mask = ad->hashcap - 1;
+  for (i = ping_prefix_hash(key) & mask; ad->hash[i] != PING_ADAPT_NONE;
+       i = (i + 1) & mask)
+    if (ad->prefix[ad->hash[i]].key == key)
+      return ad->hash[i];
+
+  if (ad->prefixlen >= ad->prefixcap) {
+    size_t cap = ad->prefixcap ? ad->prefixcap * 2 : 16;
+    struct ping_prefix *prefix = realloc(ad->prefix, sizeof(*prefix) * cap);
+
+    if (prefix == NULL)
+      return -1;
+    ad->prefix = prefix;
+    ad->prefixcap = cap;
+  }
+  pp = ad->prefix + ad->prefixlen;
+  memset(pp, 0, sizeof(*pp));
+  pp->key = key;
+  pp->rate.rate = po->prefix_rate;
+  pp->rate.ceil = po->prefix_rate;
+  pp->head = PING_ADAPT_NONE;
+  pp->tail = PING_ADAPT_NONE;
+  ad->hash[i] = ad->prefixlen;
+  return ad->prefixlen++;
+}
+
+static void ping_adapt_heap_push(struct ping_adapt *ad, uint32_t pfx) {
+  uint64_t next_ns = ad->prefix[pfx].next_ns;
+  size_t i = ad->heaplen++;
+
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+
+    if (ad->prefix[ad->heap[parent]].next_ns <= next_ns)
+      break;
+    ad->heap[i] = ad->heap[parent];
+    i = parent;
+  }
+  ad->heap[i] = pfx;
+  ad->prefix[pfx].queued = 1;
+}
+
+static uint32_t ping_adapt_heap_pop(struct ping_adapt *ad) {
+  uint32_t top = ad->heap[0];
+  uint32_t last = ad->heap[--ad->heaplen];
+  uint64_t next_ns = ad->prefix[last].next_ns;
+  size_t i = 0;
+
+  while (ad->heaplen > 0) {
+    size_t child = i * 2 + 1;
+
+    if (child >= ad->heaplen)
+      break;
+    if (child + 1 < ad->heaplen && ad->prefix[ad->heap[child + 1]].next_ns <
+                                       ad->prefix[ad->heap[child]].next_ns)
+      child++;
+    if (next_ns <= ad->prefix[ad->heap[child]].next_ns)
+      break;
+    ad->heap[i] = ad->heap[child];
+    i = child;
+  }
+  if (ad->heaplen > 0)
+    ad->heap[i] = last;
+  ad->prefix[top].queued = 0;
+  return top;
+}
+
+// 送信待ちに追加
+static void ping_adapt_enqueue(struct ping_adapt *ad, size_t idx) {
+  uint32_t pfx = ad->prefix_of[idx];
+  struct ping_prefix *pp = ad->prefix + pfx;
+
+  ad->next[idx] = PING_ADAPT_NONE;
+  if (pp->head == PING_ADAPT_NONE)
+    pp->head = idx;
+  else
+    ad->next[pp->tail] = idx;
+  pp->tail = idx;
+  ad->npending++;
+  if (!pp->queued)
+    ping_adapt_heap_push(ad, pfx);
+}
+
+static void ping_adapt_free(struct ping_adapt *ad) {
+  if (ad == NULL)
+    return;
+  free(ad->prefix);
+  free(ad->hash);
+  free(ad->heap);
+  free(ad->prefix_of);
+  free(ad->next);
+  free(ad->inflight);
+  free(ad);
+}
+
+static int ping_adapt_new(struct ping_context *ctx) {
+  struct ping_adapt *ad;
+  uint64_t interval = timespec_to_ns(ctx->opt.interval);
+  size_t n = ctx->slotlen ? ctx->slotlen : 1;
+
+  if ((ad = calloc(1, sizeof(*ad))) == NULL)
+    return -1;
+  ad->rate.ceil = ctx->opt.rate;
+  ad->rate.rate = interval ? 1e9 / interval : ad->rate.ceil;
+  if (ad->rate.rate > ad->rate.ceil)
+    ad->rate.rate = ad->rate.ceil;
+  ad->prefix_of = malloc(sizeof(*ad->prefix_of) * n);
+  ad->next = malloc(sizeof(*ad->next) * n);
+  ad->inflight = malloc(sizeof(*ad->inflight) * n);
+  if (ad->prefix_of == NULL || ad->next == NULL || ad->inflight == NULL)
+    goto err;
+
+  for (size_t i = 0; i < ctx->slotlen; i++) {
+    ssize_t pfx = ping_adapt_prefix(
+        ad, ping_prefix_key(&ctx->addrtab, i), &ctx->opt);
+
+    if (pfx == -1)
+      goto err;
+    ad->prefix_of[i] = pfx;
+  }
+  if ((ad->heap = malloc(sizeof(*ad->heap) * (ad->prefixlen + 1))) == NULL)
+    goto err;
+  for (size_t i = 0; i < ctx->slotlen; i++)
+    ping_adapt_enqueue(ad, i);
+  ctx->adapt = ad;
+  return 0;
+
+err: {
+  int _errno = errno;
+  ping_adapt_free(ad);
+  errno = _errno;
+  return -1;
+}
+}
+
+// 送信可能な宛先の取り出し
+static ssize_t ping_adapt_next(struct ping_adapt *ad, uint64_t now) {
+  struct ping_prefix *pp;
+  uint32_t pfx, idx;
+
+  if (ad->heaplen == 0 || ad->prefix[ad->heap[0]].next_ns > now)
+    return -1;
+  pfx = ping_adapt_heap_pop(ad);
+  pp = ad->prefix + pfx;
+  idx = pp->head;
+  pp->head = ad->next[idx];
+  if (pp->head == PING_ADAPT_NONE)
+    pp->tail = PING_ADAPT_NONE;
+  ad->npending--;
+  pp->next_ns = now + 1e9 / pp->rate.rate;
+  if (pp->head != PING_ADAPT_NONE)
+    ping_adapt_heap_push(ad, pfx);
+  return idx;
+}
+
+static void ping_adapt_sent(struct ping_context *ctx, size_t idx) {
+  struct ping_adapt *ad = ctx->adapt;
+
+  ad->inflight[(ad->inflight_head + ad->inflight_len++) % ctx->slotlen] = idx;
+}
+
+static int ping_adapt_done(const struct ping_adapt *ad) {
+  return ad->npending == 0 && ad->inflight_len == 0;
+}
+
+// AIMD: 損失率が閾値を超えたら半減, 応答があれば加算
+// 最初の減速までは応答毎に 1 pps 加算し (slow start),
+// 以降は応答毎に 1 / rate 加算して概ね毎秒 1 pps ずつ増やす
+// 減速は前回の減速以降に送信した要求の損失に対してのみ行う
+static void ping_rate_update(struct ping_rate *pr, int lost, uint64_t sent_ns,
+                             uint64_t now) {
+  pr->loss += PING_ADAPT_LOSS_WEIGHT * ((lost ? 1.0 : 0.0) - pr->loss);
+  if (lost) {
+    if (pr->loss > PING_ADAPT_LOSS_THRESHOLD && sent_ns >= pr->backoff_ns) {
+      pr->rate /= 2;
+      if (pr->rate < PING_ADAPT_RATE_MIN)
+        pr->rate = PING_ADAPT_RATE_MIN;
+      pr->backoff_ns = now;
+    }
+  } else if (pr->loss <= PING_ADAPT_LOSS_THRESHOLD) {
+    pr->rate += pr->backoff_ns == 0 ? 1 : 1 / pr->rate;
+    if (pr->rate > pr->ceil)
+      pr->rate = pr->ceil;
+  }
+}
+
+static void ping_adapt_recv(struct ping_context *ctx, size_t idx,
+                            uint64_t sent_ns, uint64_t now) {
+  struct ping_adapt *ad = ctx->adapt;
+  struct ping_prefix *pp = ad->prefix + ad->prefix_of[idx];
+
+  pp->nrecv++;
+  ping_rate_update(&pp->rate, 0, sent_ns, now);
+  ping_rate_update(&ad->rate, 0, sent_ns, now);
+}
+
+// 応答待ちの期限切れ処理
+// 応答実績のあるプレフィクスでの損失は送信率超過とみなし, 減速して再送する
+// ほぼ全損のプレフィクスは到達不能とみなし, 減速も再送もしない
+static void ping_adapt_expire(struct ping_context *ctx, uint64_t now) {
+  struct ping_adapt *ad = ctx->adapt;
+  uint64_t timeout = timespec_to_ns(ctx->opt.timeout);
+
+  while (ad->inflight_len > 0) {
+    uint32_t idx = ad->inflight[ad->inflight_head];
+    struct ping_slot *ps = ctx->slot + idx;
+    struct ping_prefix *pp = ad->prefix + ad->prefix_of[idx];
+
+    if (ps->state == PING_SLOT_SENT) {
+      if (ps->time_ns + timeout > now)
+        break;
+      if (pp->nrecv > 0 && pp->rate.loss < PING_ADAPT_LOSS_DARK) {
+        // 減速中のプレフィクスの損失は全体の送信率に反映しない
+        if (pp->rate.rate >= pp->rate.ceil)
+          ping_rate_update(&ad->rate, 1, ps->time_ns, now);
+        ping_rate_update(&pp->rate, 1, ps->time_ns, now);
+        if (ps->tries < PING_ADAPT_RETRIES) {
+          ps->tries++;
+          ps->nonce = (ps->nonce + 1) % ctx->nonce_mod;
+          ps->state = PING_SLOT_IDLE;
+          ping_adapt_enqueue(ad, idx);
+        }
+      }
+    }
+    ad->inflight_head = (ad->inflight_head + 1) % ctx->slotlen;
+    ad->inflight_len--;
+  }
+}
+
+static struct ping_source *ping_source_of(struct ping_context *ctx,
+                                          size_t idx) {
+  return ctx->src + (ctx->srcof != NULL ? ctx->srcof[idx] : 0);
+}
+
+// エコー要求のヘッダ (8 byte) を iov[0] に作成する
+// チェックサムは iov 全体で計算する
+static void icmp_echo_header(int family, uint32_t tag, struct iovec *iov,
+                             size_t iovlen) {
+  if (family == AF_INET) {
+    struct icmphdr *icmphdr = iov[0].iov_base;
+
+    icmphdr->type = ICMP_ECHO;
+    icmphdr->code = 0;
+    icmphdr->checksum = 0;
+    icmphdr->un.echo.id = htons(tag >> 16);
+    icmphdr->un.echo.sequence = htons(tag & 0xffff);
+    icmphdr->checksum = checksum(iov, iovlen);
+  } else {
+    struct icmp6_hdr *icmp6_hdr = iov[0].iov_base;
+
+    icmp6_hdr->icmp6_type = ICMP6_ECHO_REQUEST;
+    icmp6_hdr->icmp6_code = 0;
+    icmp6_hdr->icmp6_cksum = 0;
+    icmp6_hdr->icmp6_id = htons(tag >> 16);
+    icmp6_hdr->icmp6_seq = htons(tag & 0xffff);
+    icmp6_hdr->icmp6_cksum = checksum(iov, iovlen);
+  }
+}
+
+// 組み立て済みの要求の送信
+// ttl が 0 でなければ補助データで TTL (Hop Limit) を指定する
+static ssize_t icmp_sendmsg(int sock, const struct ping_addr *daddr,
+                            struct iovec *iov, size_t iovlen, int ttl,
+                            uint64_t *time_sent) {
+  struct msghdr msghdr;
+  struct timespec ts;
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } cmsgbuf;
+  struct cmsghdr *cmsg;
+
+  msghdr.msg_name = (void *)&daddr->addr;
+  msghdr.msg_namelen = daddr->addrlen;
   msghdr.msg_iov = iov;
-  msghdr.msg_iovlen = 2;
+  msghdr.msg_iovlen = iovlen;
   msghdr.msg_control = NULL;
   msghdr.msg_controllen = 0;
   msghdr.msg_flags = 0;
 
+  // TTL の指定
+  if (ttl > 0) {
+    msghdr.msg_control = cmsgbuf.buf;
+    msghdr.msg_controllen = sizeof(cmsgbuf.buf);
+    cmsg = CMSG_FIRSTHDR(&msghdr);
+    if (daddr->addr.sa_family == AF_INET) {
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type = IP_TTL;
+    } else {
+      cmsg->cmsg_level = IPPROTO_IPV6;
+      cmsg->cmsg_type = IPV6_HOPLIMIT;
+    }
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ttl, sizeof(int));
+  }
+
   // 送信時間の記録
-  if (clock_gettime(CLOCK_REALTIME, &pi->time_sent) == -1)
+  if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
     return -1;
+  *time_sent = timespec_to_ns(ts);
 
   // 送信
-  ret = sendmsg(pi->daddr_send.addr.sa_family == AF_INET ? ctx->sock4
-                                                         : ctx->sock6,
-                &msghdr, 0);
+  return sendmsg(sock, &msghdr, 0);
+}
+
+// 要求の送信
+// ペイロードは共有の ctx->opt.data の先頭 datalen byte
+static ssize_t icmp_echo_send(struct ping_context *ctx, size_t idx,
+                              uint32_t nonce, int ttl, size_t datalen,
+                              uint64_t *time_sent) {
+  struct iovec iov[2];
+  struct ping_addr daddr;
+  struct ping_source *src;
+  union ping_echo_hdr hdr;
+
+  ping_addrtab_get(&ctx->addrtab, idx, &daddr);
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = ctx->opt.data;
+  iov[1].iov_len = datalen;
+  icmp_echo_header(daddr.addr.sa_family, ping_tag_encode(ctx, idx, nonce), iov,
+                   2);
+
+  src = ping_source_of(ctx, idx);
+  return icmp_sendmsg(daddr.addr.sa_family == AF_INET ? src->sock4
+                                                      : src->sock6,
+                      &daddr, iov, 2, ttl, time_sent);
+}
+
+// 送信の雛形を作成する (-T, -M 以外)
+// 送信元とアドレスファミリの組毎に 1 つだけ持ち, 宛先毎には持たない
+static int ping_tmpl_new(struct ping_context *ctx) {
+  if ((ctx->tmpl = calloc(ctx->nsrc * 2, sizeof(*ctx->tmpl))) == NULL ||
+      (ctx->batch = calloc(1, sizeof(*ctx->batch))) == NULL)
+    return -1;
+  for (int i = 0; i < ctx->nsrc * 2; i++) {
+    struct ping_tmpl *pt = ctx->tmpl + i;
+    int family = i % 2 ? AF_INET6 : AF_INET;
+
+    pt->sock = i % 2 ? ctx->src[i / 2].sock6 : ctx->src[i / 2].sock4;
+    pt->iov[0].iov_base = &pt->hdr;
+    pt->iov[0].iov_len = sizeof(pt->hdr);
+    pt->iov[1].iov_base = ctx->opt.data;
+    pt->iov[1].iov_len = ctx->opt.datalen;
+    icmp_echo_header(family, 0, pt->iov, 2);
+    pt->msg.msg_iovlen = 2;
+  }
+  ctx->batch->max = ctx->opt.precision ? 1 : PING_BATCH_MAX;
+  return 0;
+}
+
+// ヘッダの id/seq を書き換え, チェックサムは差分だけを更新する (RFC 1624)
+static void ping_hdr_patch(union ping_echo_hdr *hdr, uint32_t tag) {
+  struct icmphdr *icmphdr = &hdr->icmphdr;
+  uint16_t id = htons(tag >> 16), seq = htons(tag & 0xffff);
+  uint32_t sum = (uint16_t)~icmphdr->checksum;
+
+  sum += (uint16_t)~icmphdr->un.echo.id + id;
+  sum += (uint16_t)~icmphdr->un.echo.sequence + seq;
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  icmphdr->checksum = ~sum;
+  icmphdr->un.echo.id = id;
+  icmphdr->un.echo.sequence = seq;
+}
+
+// 溜めた要求をソケット毎にまとめて送信する
+// 送信時刻はまとめて記録する
+static int ping_batch_flush(struct ping_context *ctx) {
+  struct ping_batch *pb = ctx->batch;
+  struct mmsghdr msg[PING_BATCH_MAX];
+  struct timespec ts;
+  uint64_t time_sent;
+
+  if (pb == NULL || pb->len == 0)
+    return 0;
+  if (clock_gettime(CLOCK_REALTIME, &ts) == -1)
+    return -1;
+  time_sent = timespec_to_ns(ts);
+  for (size_t i = 0; i < pb->len; i++)
+    ctx->slot[pb->idx[i]].time_ns = time_sent;
+  for (size_t i = 0; i < pb->len; i++) {
+    int sock = pb->sock[i];
+    size_t n = 0, off = 0;
+
+    // 送信済みは -1
+    if (sock == -1)
+      continue;
+    for (size_t j = i; j < pb->len; j++)
+      if (pb->sock[j] == sock) {
+        msg[n++] = pb->msg[j];
+        pb->sock[j] = -1;
+      }
+    while (off < n) {
+      int ret = sendmmsg(sock, msg + off, n - off, 0);
+
+      if (ret == -1) {
+        pb->len = 0;
+        return -1;
+      }
+      off += ret;
+    }
+  }
+  pb->len = 0;
+  return 0;
+}
+
+// 雛形と宛先表から要求を組み立てて溜める
+static ssize_t ping_slot_send(struct ping_context *ctx, size_t idx) {
+  struct ping_slot *ps = ctx->slot + idx;
+  struct ping_batch *pb = ctx->batch;
+  const struct ping_tmpl *pt;
+  size_t n;
+
+  if (pb->len >= pb->max && ping_batch_flush(ctx) == -1)
+    return -1;
+  pt = ctx->tmpl + (ctx->srcof != NULL ? ctx->srcof[idx] : 0) * 2 +
+       (ctx->addrtab.ref[idx] & PING_ADDRREF_INET6 ? 1 : 0);
+  n = pb->len++;
+  ping_addrtab_get(&ctx->addrtab, idx, &pb->daddr[n]);
+  pb->hdr[n] = pt->hdr;
+  ping_hdr_patch(&pb->hdr[n], ping_tag_encode(ctx, idx, ps->nonce));
+  pb->iov[n][0].iov_base = &pb->hdr[n];
+  pb->iov[n][0].iov_len = sizeof(pb->hdr[n]);
+  pb->iov[n][1] = pt->iov[1];
+  pb->msg[n].msg_hdr = pt->msg;
+  pb->msg[n].msg_hdr.msg_name = &pb->daddr[n].addr;
+  pb->msg[n].msg_hdr.msg_namelen = pb->daddr[n].addrlen;
+  pb->msg[n].msg_hdr.msg_iov = pb->iov[n];
+  pb->idx[n] = idx;
+  pb->sock[n] = pt->sock;
+  ps->state = PING_SLOT_SENT;
+  return 0;
+}
+
+// PING要求と引当
+static ssize_t ping_slot_match(struct ping_context *ctx,
+                               const struct ping_reply *reply) {
+  struct ping_slot *ps;
+  uint32_t nonce;
+  ssize_t idx;
+
+  if (reply->kind != PING_REPLY_ECHO) {
+    errno = EAGAIN;
+    return -1;
+  }
+  idx = ping_tag_decode(ctx, reply->tag, &nonce);
+  if (idx == -1 || ctx->slot[idx].nonce != nonce) {
+    // 応答が要求と異なる
+    errno = EAGAIN;
+    return -1;
+  }
+  ps = ctx->slot + idx;
+  switch (ps->state) {
+  case PING_SLOT_SENT:
+    if (ctx->adapt != NULL)
+      ping_adapt_recv(ctx, idx, ps->time_ns, reply->time_ns);
+    ps->time_ns = reply->time_ns - ps->time_ns;
+    ps->state = PING_SLOT_RECV;
+    break;
+  case PING_SLOT_RECV:
+    break;
+  default:
+    errno = EAGAIN;
+    return -1;
+  }
+  ps->count_recv++;
+  return idx;
+}
+
+static int ping_trace_new(struct ping_context *ctx) {
+  struct ping_trace *tr;
+  size_t nhops = ctx->slotlen * ctx->opt.ttl;
+
+  if (ctx->opt.ttl == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ctx->slotlen > 0 && ctx->nonce_mod <= ctx->opt.ttl) {
+    errno = E2BIG;
+    return -1;
+  }
+  if ((tr = calloc(1, sizeof(*tr))) == NULL)
+    return -1;
+  ctx->trace = tr;
+  tr->maxttl = ctx->opt.ttl;
+  tr->hop = calloc(nhops ? nhops : 1, sizeof(*tr->hop));
+  tr->hopaddr.ref = calloc(nhops ? nhops : 1, sizeof(*tr->hopaddr.ref));
+  tr->reach = calloc(ctx->slotlen ? ctx->slotlen : 1, sizeof(*tr->reach));
+  if (tr->hop == NULL || tr->hopaddr.ref == NULL || tr->reach == NULL)
+    return -1;
+  return 0;
+}
+
+static void ping_trace_free(struct ping_trace *tr) {
+  if (tr == NULL)
+    return;
+  free(tr->hop);
+  ping_addrtab_free(&tr->hopaddr);
+  free(tr->reach);
+  free(tr);
+}
+
+// 次に送信する宛先と TTL
+// 宛先に到達済みの TTL より遠いホップは送信しない
+static ssize_t ping_trace_next(struct ping_context *ctx, int *ttl) {
+  struct ping_trace *tr = ctx->trace;
+
+  for (; ctx->sndidx < ctx->slotlen * tr->maxttl; ctx->sndidx++) {
+    size_t idx = ctx->sndidx % ctx->slotlen;
+    int t = ctx->sndidx / ctx->slotlen + 1;
+
+    if (tr->reach[idx] == 0 || t < tr->reach[idx]) {
+      *ttl = t;
+      return idx;
+    }
+  }
+  return -1;
+}
+
+static ssize_t ping_trace_send(struct ping_context *ctx) {
+  struct ping_hop *hop;
+  ssize_t idx, ret;
+  int ttl;
+
+  if ((idx = ping_trace_next(ctx, &ttl)) == -1)
+    return 0;
+  hop = ctx->trace->hop + idx * ctx->trace->maxttl + ttl - 1;
+  ret = icmp_echo_send(ctx, idx, ttl, ttl, ctx->opt.datalen, &hop->time_ns);
   if (ret != -1) {
-    ctx->id++;
+    hop->state = PING_SLOT_SENT;
     ctx->sndidx++;
   }
   return ret;
 }
 
-static int icmp4_echoreply_recv(struct ping_context *ctx) {
+// 経路上の応答と引当
+static ssize_t ping_trace_match(struct ping_context *ctx,
+                                const struct ping_reply *reply) {
+  struct ping_trace *tr = ctx->trace;
+  struct ping_hop *hop;
+  uint32_t ttl;
+  size_t hopidx;
+  ssize_t idx;
+
+  idx = ping_tag_decode(ctx, reply->tag, &ttl);
+  if (idx == -1 || ttl == 0 || ttl > tr->maxttl) {
+    errno = EAGAIN;
+    return -1;
+  }
+  hopidx = idx * tr->maxttl + ttl - 1;
+  hop = tr->hop + hopidx;
+  if (hop->state != PING_SLOT_SENT) {
+    errno = EAGAIN;
+    return -1;
+  }
+  if (ping_addrtab_add(&tr->hopaddr, hopidx, &reply->saddr.addr) == -1)
+    return -1;
+  hop->time_ns = reply->time_ns - hop->time_ns;
+  hop->state = PING_SLOT_RECV;
+  hop->kind = reply->kind;
+  hop->code = reply->code;
+  if (reply->kind == PING_REPLY_ECHO || reply->kind == PING_REPLY_UNREACH)
+    if (tr->reach[idx] == 0 || ttl < tr->reach[idx])
+      tr->reach[idx] = ttl;
+  return idx;
+}
+
+// 宛先毎のホップ一覧の出力
+static void ping_trace_print(struct ping_context *ctx) {
+  struct ping_trace *tr = ctx->trace;
+
+  for (size_t idx = 0; idx < ctx->slotlen; idx++) {
+    struct ping_hop *hops = tr->hop + idx * tr->maxttl;
+    char addr[NI_MAXHOST], daddr_name[2 * NI_MAXHOST];
+    struct ping_addr daddr;
+    int last = tr->reach[idx];
+
+    // 未到達なら最後に応答したホップの次まで
+    if (last == 0) {
+      for (int ttl = tr->maxttl; ttl > 0 && last == 0; ttl--)
+        if (hops[ttl - 1].state == PING_SLOT_RECV)
+          last = ttl;
+      if (last < tr->maxttl)
+        last++;
+    }
+
+    ping_addrtab_get(&ctx->addrtab, idx, &daddr);
+    if (getnameinfo(&daddr.addr, daddr.addrlen, addr, sizeof(addr), NULL, 0,
+                    NI_NUMERICHOST) != 0)
+      strcpy(addr, "???");
+    // -F: 指定された名前とアドレスを並べる
+    if (ctx->nameof != NULL)
+      snprintf(daddr_name, sizeof(daddr_name), "%s %s",
+               ctx->names[ctx->nameof[idx]], addr);
+    else
+      strcpy(daddr_name, addr);
+    for (int ttl = 1; ttl <= last; ttl++) {
+      struct ping_hop *hop = hops + ttl - 1;
+      char saddr_name[NI_MAXHOST];
+      struct ping_addr saddr;
+
+      if (hop->state != PING_SLOT_RECV) {
+        printf("%s %d * 0.000000", daddr_name, ttl);
+        if (ctx->opt.nsrc > 0)
+          printf(" %s", ping_source_of(ctx, idx)->name);
+        printf("\n");
+        continue;
+      }
+      ping_addrtab_get(&tr->hopaddr, idx * tr->maxttl + ttl - 1, &saddr);
+      if (getnameinfo(&saddr.addr, saddr.addrlen, saddr_name,
+                      sizeof(saddr_name), NULL, 0, NI_NUMERICHOST) != 0)
+        strcpy(saddr_name, "???");
+      printf("%s %d %s %lu.%06lu", daddr_name, ttl, saddr_name,
+             (unsigned long)(hop->time_ns / 1000000000),
+             (unsigned long)(hop->time_ns % 1000000000 / 1000));
+      if (hop->kind == PING_REPLY_UNREACH)
+        printf(" !%d", hop->code);
+      if (ctx->opt.nsrc > 0)
+        printf(" %s", ping_source_of(ctx, idx)->name);
+      printf("\n");
+    }
+  }
+  ctx->nprinted = ctx->slotlen;
+}
+
+static int ping_pmtu_new(struct ping_context *ctx) {
+  if ((ctx->pmtu = calloc(ctx->slotlen ? ctx->slotlen : 1,
+                          sizeof(*ctx->pmtu))) == NULL)
+    return -1;
+  for (size_t idx = 0; idx < ctx->slotlen; idx++) {
+    struct ping_pmtu *pm = ctx->pmtu + idx;
+
+    pm->lo = ctx->addrtab.ref[idx] & PING_ADDRREF_INET6 ? PING_PMTU_MIN6
+                                                        : PING_PMTU_MIN4;
+    pm->hi = PING_PMTU_MAX;
+    pm->probe_hi = 1;
+  }
+  return 0;
+}
+
+// 次に送信する宛先
+static ssize_t ping_pmtu_next(struct ping_context *ctx) {
+  for (; ctx->sndidx < ctx->slotlen; ctx->sndidx++)
+    if (ctx->pmtu[ctx->sndidx].lo < ctx->pmtu[ctx->sndidx].hi)
+      return ctx->sndidx;
+  return -1;
+}
+
+// 探索中の大きさで送信する
+// 送信元で大きすぎる (EMSGSIZE) 場合はその場で上限を下げて再送する
+static ssize_t ping_pmtu_send(struct ping_context *ctx) {
+  struct ping_slot *ps;
+  struct ping_pmtu *pm;
+  size_t hdrlen;
+  ssize_t idx;
+
+  if ((idx = ping_pmtu_next(ctx)) == -1)
+    return 0;
+  ps = ctx->slot + idx;
+  pm = ctx->pmtu + idx;
+  hdrlen = ctx->addrtab.ref[idx] & PING_ADDRREF_INET6
+               ? sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr)
+               : sizeof(struct iphdr) + sizeof(struct icmphdr);
+  while (pm->lo < pm->hi) {
+    pm->size = pm->probe_hi ? pm->hi : pm->lo + (pm->hi - pm->lo + 1) / 2;
+    if (icmp_echo_send(ctx, idx, ps->nonce, 0, pm->size - hdrlen,
+                       &ps->time_ns) != -1) {
+      ps->state = PING_SLOT_SENT;
+      break;
+    }
+    if (errno != EMSGSIZE)
+      return -1;
+    ps->tries = 0;
+    pm->hi = pm->size - 1;
+    pm->probe_hi = 0;
+  }
+  ctx->sndidx++;
+  return 1;
+}
+
+// 応答と引当
+// Fragmentation Needed / Packet Too Big は通知された MTU を次の候補にする
+static ssize_t ping_pmtu_match(struct ping_context *ctx,
+                               const struct ping_reply *reply) {
+  struct ping_slot *ps;
+  struct ping_pmtu *pm;
+  uint32_t nonce;
+  ssize_t idx;
+
+  idx = ping_tag_decode(ctx, reply->tag, &nonce);
+  if (idx == -1 || ctx->slot[idx].nonce != nonce ||
+      ctx->slot[idx].state != PING_SLOT_SENT) {
+    errno = EAGAIN;
+    return -1;
+  }
+  ps = ctx->slot + idx;
+  pm = ctx->pmtu + idx;
+  switch (reply->kind) {
+  case PING_REPLY_ECHO:
+    ps->time_ns = reply->time_ns - ps->time_ns;
+    ps->state = PING_SLOT_RECV;
+    ps->count_recv++;
+    ps->tries = 0;
+    pm->lo = pm->size;
+    pm->probe_hi = 0;
+    break;
+
+  case PING_REPLY_TOOBIG:
+    ps->state = PING_SLOT_IDLE;
+    ps->tries = 0;
+    if (reply->mtu > pm->lo && reply->mtu < pm->size) {
+      pm->hi = reply->mtu;
+      pm->probe_hi = 1;
+    } else {
+      pm->hi = pm->size - 1;
+      pm->probe_hi = 0;
+    }
+    break;
+
+  default:
+    errno = EAGAIN;
+    return -1;
+  }
+  return idx;
+}
+
+// 周回の終了処理: 応答のない大きさは nonce を変えて再送し,
+// PING_PMTU_RETRIES 回再送しても応答がなければ通過しないとみなす
+// 探索中の宛先の数を返す
+static size_t ping_pmtu_round(struct ping_context *ctx) {
+  size_t active = 0;
+
+  for (size_t idx = 0; idx < ctx->slotlen; idx++) {
+    struct ping_slot *ps = ctx->slot + idx;
+    struct ping_pmtu *pm = ctx->pmtu + idx;
+
+    if (pm->lo >= pm->hi)
+      continue;
+    if (ps->state == PING_SLOT_SENT) {
+      if (ps->tries < PING_PMTU_RETRIES)
+        ps->tries++;
+      else {
+        ps->tries = 0;
+        pm->hi = pm->size - 1;
+        pm->probe_hi = 0;
+      }
+    }
+    ps->state = PING_SLOT_IDLE;
+    ps->nonce = (ps->nonce + 1) % ctx->nonce_mod;
+    if (pm->lo < pm->hi)
+      active++;
+  }
+  ctx->sndidx = 0;
+  return active;
+}
+
+static ssize_t ping_reply_match(struct ping_context *ctx,
+                                const struct ping_reply *reply) {
+  // 宛先に割り当てた送信元以外で受信した応答は無視する
+  if (ctx->srcof != NULL) {
+    uint32_t nonce;
+    ssize_t idx = ping_tag_decode(ctx, reply->tag, &nonce);
+
+    if (idx == -1 || ctx->srcof[idx] != reply->src) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  if (ctx->trace != NULL)
+    return ping_trace_match(ctx, reply);
+  if (ctx->pmtu != NULL)
+    return ping_pmtu_match(ctx, reply);
+  return ping_slot_match(ctx, reply);
+}
+
+static int icmp4_recv(int sock, int srcidx, struct ping_reply *reply) {
   struct iphdr iphdr;
   struct icmphdr icmphdr;
   char data[MAX_DATALEN4];
   struct msghdr msghdr;
   struct iovec iov[3];
-  struct sockaddr_in sin;
+  struct timespec time_recv;
+  uint16_t id, seq;
+  size_t datalen;
 
   memset(&msghdr, 0, sizeof(msghdr));
   // 受信情報の作成
@@ -237,21 +1373,23 @@ static int icmp4_echoreply_recv(struct ping_context *ctx) {
   iov[1].iov_len = sizeof(icmphdr);
   iov[2].iov_base = data;
   iov[2].iov_len = sizeof(data);
-  msghdr.msg_name = &sin;
+  msghdr.msg_name = &reply->saddr.addr4;
   msghdr.msg_namelen = sizeof(struct sockaddr_in);
   msghdr.msg_iov = iov;
   msghdr.msg_iovlen = 3;
   msghdr.msg_control = NULL;
   msghdr.msg_controllen = 0;
   msghdr.msg_flags = 0;
-  int ret = recvmsg(ctx->sock4, &msghdr, 0);
-  if (ret < 1)
-    return ret;
+  int ret = recvmsg(sock, &msghdr, 0);
+  if (ret == -1)
+    return -1;
+  reply->saddr.addrlen = msghdr.msg_namelen;
 
   if (ret < sizeof(iphdr) + sizeof(icmphdr)) {
     errno = EINVAL;
     return -1;
   }
+  datalen = ret - sizeof(iphdr) - sizeof(icmphdr);
   // PARSE IP HEADER
   if (iphdr.protocol != IPPROTO_ICMP) {
     errno = EAGAIN;
@@ -259,36 +1397,68 @@ static int icmp4_echoreply_recv(struct ping_context *ctx) {
   }
 
   // PARSE ICMP HEADER
-  if (icmphdr.type != ICMP_ECHOREPLY) {
-    errno = EAGAIN;
-    return -1;
-  }
+  switch (icmphdr.type) {
+  case ICMP_ECHOREPLY:
+    reply->kind = PING_REPLY_ECHO;
+    id = icmphdr.un.echo.id;
+    seq = icmphdr.un.echo.sequence;
+    break;
 
-  // PING要求と引当
-  for (int i = 0; i < ctx->sndidx; i++) {
-    struct ping_info *pi = ctx->info + i;
+  case ICMP_TIME_EXCEEDED:
+  case ICMP_DEST_UNREACH: {
+    // エラーに含まれる元の要求
+    struct iphdr inner_iphdr;
+    struct icmphdr inner_icmphdr;
 
-    if (icmphdr.un.echo.id == htons(pi->id) &&
-        icmphdr.un.echo.sequence == htons(pi->seq)) {
-      if (ioctl(ctx->sock4, SIOCGSTAMPNS, &pi->time_recv) != 0)
-        return -1;
-      memcpy(&pi->saddr_recv.addr, msghdr.msg_name, msghdr.msg_namelen);
-      pi->saddr_recv.addrlen = msghdr.msg_namelen;
-      return i;
+    if (datalen < sizeof(inner_iphdr)) {
+      errno = EAGAIN;
+      return -1;
+    }
+    memcpy(&inner_iphdr, data, sizeof(inner_iphdr));
+    if (inner_iphdr.protocol != IPPROTO_ICMP ||
+        datalen < inner_iphdr.ihl * 4 + sizeof(inner_icmphdr)) {
+      errno = EAGAIN;
+      return -1;
     }
+    memcpy(&inner_icmphdr, data + inner_iphdr.ihl * 4, sizeof(inner_icmphdr));
+    if (inner_icmphdr.type != ICMP_ECHO) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (icmphdr.type == ICMP_TIME_EXCEEDED)
+      reply->kind = PING_REPLY_TIMXCEED;
+    else if (icmphdr.code == ICMP_FRAG_NEEDED)
+      reply->kind = PING_REPLY_TOOBIG;
+    else
+      reply->kind = PING_REPLY_UNREACH;
+    reply->mtu = ntohs(icmphdr.un.frag.mtu);
+    id = inner_icmphdr.un.echo.id;
+    seq = inner_icmphdr.un.echo.sequence;
+    break;
   }
 
-  // 応答が要求と異なる
-  errno = EAGAIN;
-  return -1;
+  default:
+    errno = EAGAIN;
+    return -1;
+  }
+  reply->code = icmphdr.code;
+  reply->tag = (uint32_t)ntohs(id) << 16 | ntohs(seq);
+
+  if (ioctl(sock, SIOCGSTAMPNS, &time_recv) != 0)
+    return -1;
+  reply->time_ns = timespec_to_ns(time_recv);
+  reply->src = srcidx;
+  return 0;
 }
 
-static int icmp6_echoreply_recv(struct ping_context *ctx) {
+static int icmp6_recv(int sock, int srcidx, struct ping_reply *reply) {
   struct icmp6_hdr icmp6_hdr;
   char data[MAX_DATALEN6];
   struct msghdr msghdr;
   struct iovec iov[2];
-  struct sockaddr_in6 sin6;
+  struct timespec time_recv;
+  uint16_t id, seq;
+  size_t datalen;
 
   memset(&msghdr, 0, sizeof(msghdr));
   // 受信情報の作成
@@ -296,45 +1466,75 @@ static int icmp6_echoreply_recv(struct ping_context *ctx) {
   iov[0].iov_len = sizeof(icmp6_hdr);
   iov[1].iov_base = data;
   iov[1].iov_len = sizeof(data);
-  msghdr.msg_name = &sin6;
+  msghdr.msg_name = &reply->saddr.addr6;
   msghdr.msg_namelen = sizeof(struct sockaddr_in6);
   msghdr.msg_iov = iov;
-  msghdr.msg_iovlen = 3;
+  msghdr.msg_iovlen = 2;
   msghdr.msg_control = NULL;
   msghdr.msg_controllen = 0;
   msghdr.msg_flags = 0;
-  int ret = recvmsg(ctx->sock6, &msghdr, 0);
-  if (ret < 1)
-    return ret;
+  int ret = recvmsg(sock, &msghdr, 0);
+  if (ret == -1)
+    return -1;
+  reply->saddr.addrlen = msghdr.msg_namelen;
 
   if (ret < sizeof(icmp6_hdr)) {
     errno = EINVAL;
     return -1;
   }
+  datalen = ret - sizeof(icmp6_hdr);
 
   // PARSE ICMP HEADER
-  if (icmp6_hdr.icmp6_type != ICMP6_ECHO_REPLY) {
-    errno = EAGAIN;
-    return -1;
-  }
+  switch (icmp6_hdr.icmp6_type) {
+  case ICMP6_ECHO_REPLY:
+    reply->kind = PING_REPLY_ECHO;
+    id = icmp6_hdr.icmp6_id;
+    seq = icmp6_hdr.icmp6_seq;
+    break;
 
-  // PING要求と引当
-  for (int i = 0; i < ctx->sndidx; i++) {
-    struct ping_info *pi = ctx->info + i;
+  case ICMP6_TIME_EXCEEDED:
+  case ICMP6_DST_UNREACH:
+  case ICMP6_PACKET_TOO_BIG: {
+    // エラーに含まれる元の要求
+    struct ip6_hdr inner_ip6_hdr;
+    struct icmp6_hdr inner_icmp6_hdr;
 
-    if (icmp6_hdr.icmp6_id == htons(pi->id) &&
-        icmp6_hdr.icmp6_seq == htons(pi->seq)) {
-      if (ioctl(ctx->sock6, SIOCGSTAMPNS, &pi->time_recv) != 0)
-        return -1;
-      memcpy(&pi->saddr_recv, msghdr.msg_name, msghdr.msg_namelen);
-      pi->saddr_recv.addrlen = msghdr.msg_namelen;
-      return i;
+    if (datalen < sizeof(inner_ip6_hdr) + sizeof(inner_icmp6_hdr)) {
+      errno = EAGAIN;
+      return -1;
+    }
+    memcpy(&inner_ip6_hdr, data, sizeof(inner_ip6_hdr));
+    memcpy(&inner_icmp6_hdr, data + sizeof(inner_ip6_hdr),
+           sizeof(inner_icmp6_hdr));
+    if (inner_ip6_hdr.ip6_nxt != IPPROTO_ICMPV6 ||
+        inner_icmp6_hdr.icmp6_type != ICMP6_ECHO_REQUEST) {
+      errno = EAGAIN;
+      return -1;
     }
+    if (icmp6_hdr.icmp6_type == ICMP6_TIME_EXCEEDED)
+      reply->kind = PING_REPLY_TIMXCEED;
+    else if (icmp6_hdr.icmp6_type == ICMP6_PACKET_TOO_BIG)
+      reply->kind = PING_REPLY_TOOBIG;
+    else
+      reply->kind = PING_REPLY_UNREACH;
+    reply->mtu = ntohl(icmp6_hdr.icmp6_mtu);
+    id = inner_icmp6_hdr.icmp6_id;
+    seq = inner_icmp6_hdr.icmp6_seq;
+    break;
   }
 
-  // 応答が要求と異なる
-  errno = EAGAIN;
-  return -1;
+  default:
+    errno = EAGAIN;
+    return -1;
+  }
+  reply->code = icmp6_hdr.icmp6_code;
+  reply->tag = (uint32_t)ntohs(id) << 16 | ntohs(seq);
+
+  if (ioctl(sock, SIOCGSTAMPNS, &time_recv) != 0)
+    return -1;
+  reply->time_ns = timespec_to_ns(time_recv);
+  reply->src = srcidx;
+  return 0;
 }
 
 static struct ping_option po_defaults() {
@@ -345,26 +1545,104 @@ static struct ping_option po_defaults() {
   po.datalen = PINGOPT_DATALEN_DEFAULT;
   po.interval = PINGOPT_INTERVAL_DEFAULT;
   po.timeout = PINGOPT_TIMEOUT_DEFAULT;
+  po.rate = PINGOPT_RATE_DEFAULT;
+  po.prefix_rate = PINGOPT_PREFIX_RATE_DEFAULT;
+  po.count = PINGOPT_COUNT_DEFAULT;
+  po.period = PINGOPT_PERIOD_DEFAULT;
+  po.misses = PINGOPT_MISSES_DEFAULT;
+  po.heartbeat = PINGOPT_HEARTBEAT_DEFAULT;
+  po.ring_path = NULL;
+  po.ring_capacity = MPING_RING_CAPACITY_DEFAULT;
+  po.cpu = -1;
   po.pstderr = isatty(STDIN_FILENO);
 
   return po;
 }
 
-static int ping_context_new(struct ping_context *pc, struct ping_option *po) {
-  pc->sock4 = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-  if (pc->sock4 == -1)
-    return -1;
-  pc->sock6 = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
-  if (pc->sock6 == -1) {
-    int _errno = errno;
-    close(pc->sock4);
-    errno = _errno;
-    return -1;
+static void ping_source_close(struct ping_source *src) {
+  if (src->sock4 != -1)
+    close(src->sock4);
+  if (src->sock6 != -1)
+    close(src->sock6);
+  src->sock4 = -1;
+  src->sock6 = -1;
+}
+
+// 送信元のソケットを開く
+// アドレス指定ならそのアドレスファミリのソケットだけを開いて bind する
+static int ping_source_open(struct ping_source *src,
+                            const struct ping_option *po) {
+  struct addrinfo hints, *ai = NULL;
+  int err;
+
+  src->sock4 = -1;
+  src->sock6 = -1;
+  if (src->type == PING_SOURCE_ADDR) {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_RAW;
+    hints.ai_flags = AI_NUMERICHOST;
+    if ((err = getaddrinfo(src->name, NULL, &hints, &ai)) != 0) {
+      syslog(LOG_ERR, "%s: %s", src->name, gai_strerror(err));
+      errno = EINVAL;
+      return -1;
+    }
   }
+  if (ai == NULL || ai->ai_family == AF_INET)
+    if ((src->sock4 = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) == -1)
+      goto err;
+  if (ai == NULL || ai->ai_family == AF_INET6)
+    if ((src->sock6 = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) == -1)
+      goto err;
+  if (ai != NULL && bind(ai->ai_family == AF_INET ? src->sock4 : src->sock6,
+                         ai->ai_addr, ai->ai_addrlen) == -1)
+    goto err;
+  if (src->type == PING_SOURCE_IFACE &&
+      (setsockopt(src->sock4, SOL_SOCKET, SO_BINDTODEVICE, src->name,
+                  strlen(src->name)) == -1 ||
+       setsockopt(src->sock6, SOL_SOCKET, SO_BINDTODEVICE, src->name,
+                  strlen(src->name)) == -1))
+    goto err;
+  if (icmp_setopt(po, src->sock4, src->sock6) == -1)
+    goto err;
+  if (ai != NULL)
+    freeaddrinfo(ai);
+  return 0;
+
+err: {
+  int _errno = errno;
+  ping_source_close(src);
+  if (ai != NULL)
+    freeaddrinfo(ai);
+  errno = _errno;
+  return -1;
+}
+}
+
+static int ping_context_new(struct ping_context *pc, struct ping_option *po) {
+  pc->opt = po ? *po : po_defaults();
+  pc->nsrc = pc->opt.nsrc ? pc->opt.nsrc : 1;
+  pc->srcof = NULL;
+  if (pc->opt.nsrc == 0) {
+    pc->src[0].type = PING_SOURCE_DEFAULT;
+    pc->src[0].name = NULL;
+  } else
+    memcpy(pc->src, pc->opt.src, sizeof(*pc->src) * pc->nsrc);
+  for (int i = 0; i < pc->nsrc; i++)
+    if (ping_source_open(pc->src + i, &pc->opt) == -1) {
+      int _errno = errno;
+      if (pc->src[i].name != NULL)
+        syslog(LOG_ERR, "%s: %s", pc->src[i].name, strerror(errno));
+      while (i-- > 0)
+        ping_source_close(pc->src + i);
+      errno = _errno;
+      return -1;
+    }
   pc->asyncns = asyncns_new(2);
   if (pc->asyncns == NULL) {
     int _errno = errno;
-    close(pc->sock4);
+    for (int i = 0; i < pc->nsrc; i++)
+      ping_source_close(pc->src + i);
     errno = _errno;
     return -1;
   }
@@ -372,46 +1650,174 @@ static int ping_context_new(struct ping_context *pc, struct ping_option *po) {
   pc->timeoutfd = timerfd_create(CLOCK_MONOTONIC, 0);
   if (pc->timeoutfd == -1) {
     int _errno = errno;
-    close(pc->sock4);
-    close(pc->sock6);
+    for (int i = 0; i < pc->nsrc; i++)
+      ping_source_close(pc->src + i);
+    asyncns_free(pc->asyncns);
+    errno = _errno;
+    return -1;
+  }
+  pc->intervalfd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (pc->intervalfd == -1) {
+    int _errno = errno;
+    for (int i = 0; i < pc->nsrc; i++)
+      ping_source_close(pc->src + i);
+    close(pc->timeoutfd);
     asyncns_free(pc->asyncns);
     errno = _errno;
     return -1;
   }
-  pc->intervalfd = timerfd_create(CLOCK_MONOTONIC, 0);
-  if (pc->intervalfd == -1) {
-    int _errno = errno;
-    close(pc->sock4);
-    close(pc->sock6);
-    close(pc->timeoutfd);
-    asyncns_free(pc->asyncns);
-    errno = _errno;
+  pc->key = (uint32_t)getpid() << 16;
+  pc->nonce_mod = 0;
+  pc->slot = NULL;
+  memset(&pc->addrtab, 0, sizeof(pc->addrtab));
+  pc->slotlen = 0;
+  pc->slotcap = 0;
+  pc->sndidx = 0;
+  pc->nprinted = 0;
+  pc->adapt = NULL;
+  pc->trace = NULL;
+  pc->pmtu = NULL;
+  pc->mon = NULL;
+  pc->ring = NULL;
+  pc->nameof = NULL;
+  pc->names = NULL;
+  pc->tmpl = NULL;
+  pc->batch = NULL;
+  pc->round = 0;
+  pc->round_start_ns = 0;
+  pc->round_pending = 0;
+  return 0;
+}
+
+static void ping_context_destory(struct ping_context *pc) {
+  for (int i = 0; i < pc->nsrc; i++)
+    ping_source_close(pc->src + i);
+  asyncns_free(pc->asyncns);
+  if (pc->timeoutfd != -1)
+    close(pc->timeoutfd);
+  if (pc->intervalfd != -1)
+    close(pc->intervalfd);
+  free(pc->slot);
+  free(pc->srcof);
+  ping_addrtab_free(&pc->addrtab);
+  ping_adapt_free(pc->adapt);
+  ping_trace_free(pc->trace);
+  free(pc->pmtu);
+  free(pc->mon);
+  free(pc->tmpl);
+  free(pc->batch);
+  free(pc->nameof);
+  if (pc->ring != NULL) {
+    mping_ring_close(pc->ring, 1);
+    free(pc->ring);
+  }
+}
+
+// 宛先を送信元に割り当てる
+// 同じアドレスファミリの送信元の間で順番に (-H: 宛先アドレスのハッシュで)
+static int ping_source_assign(struct ping_context *pc) {
+  uint8_t src4[PING_SOURCE_MAX], src6[PING_SOURCE_MAX];
+  size_t nsrc4 = 0, nsrc6 = 0, rr4 = 0, rr6 = 0;
+
+  for (int i = 0; i < pc->nsrc; i++) {
+    if (pc->src[i].sock4 != -1)
+      src4[nsrc4++] = i;
+    if (pc->src[i].sock6 != -1)
+      src6[nsrc6++] = i;
+  }
+  // 送信元が 1 つでもアドレスファミリは確認する
+  if (pc->nsrc <= 1) {
+    for (size_t idx = 0; idx < pc->slotlen; idx++)
+      if ((pc->addrtab.ref[idx] & PING_ADDRREF_INET6 ? nsrc6 : nsrc4) == 0) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+      }
+    return 0;
+  }
+  if ((pc->srcof = malloc(pc->slotlen ? pc->slotlen : 1)) == NULL)
+    return -1;
+  for (size_t idx = 0; idx < pc->slotlen; idx++) {
+    uint32_t ref = pc->addrtab.ref[idx];
+    uint64_t key;
+
+    if (ref & PING_ADDRREF_INET6) {
+      const struct in6_addr *addr =
+          &pc->addrtab.addr6[ref & ~PING_ADDRREF_INET6].addr;
+      uint64_t lo;
+
+      if (nsrc6 == 0) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+      }
+      memcpy(&key, addr->s6_addr, sizeof(key));
+      memcpy(&lo, addr->s6_addr + sizeof(key), sizeof(lo));
+      key ^= lo;
+      pc->srcof[idx] = src6[pc->opt.srchash ? ping_prefix_hash(key) % nsrc6
+                                            : rr6++ % nsrc6];
+    } else {
+      if (nsrc4 == 0) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+      }
+      key = pc->addrtab.addr4[ref].s_addr;
+      pc->srcof[idx] = src4[pc->opt.srchash ? ping_prefix_hash(key) % nsrc4
+                                            : rr4++ % nsrc4];
+    }
+  }
+  return 0;
+}
+
+// 宛先表の確保
+// 宛先は ping_context_add で追加する (-F では slotcap を超えれば拡張する)
+static int ping_context_alloc(struct ping_context *pc, size_t slotcap) {
+  if (slotcap == 0)
+    slotcap = 1;
+  pc->slot = calloc(slotcap, sizeof(*pc->slot));
+  if (pc->slot == NULL)
     return -1;
-  }
-  pc->id = getpid();
-  pc->info = NULL;
-  pc->infolen = 0;
-  pc->sndidx = 0;
-  pc->opt = po ? *po : po_defaults();
-  if (icmp_setopt(pc) == -1) {
-    int _errno = errno;
-    close(pc->sock4);
-    close(pc->sock6);
-    asyncns_free(pc->asyncns);
-    errno = _errno;
+  pc->addrtab.ref = calloc(slotcap, sizeof(*pc->addrtab.ref));
+  if (pc->addrtab.ref == NULL)
     return -1;
-  }
+  if (pc->opt.fanout != PING_FANOUT_NONE &&
+      (pc->nameof = calloc(slotcap, sizeof(*pc->nameof))) == NULL)
+    return -1;
+  pc->slotcap = slotcap;
   return 0;
 }
 
-static void ping_context_destory(struct ping_context *pc) {
-  close(pc->sock4);
-  close(pc->sock6);
-  asyncns_free(pc->asyncns);
-  if (pc->timeoutfd != -1)
-    close(pc->timeoutfd);
-  if (pc->intervalfd != -1)
-    close(pc->intervalfd);
+// 宛先の追加
+static int ping_context_add(struct ping_context *pc,
+                            const struct sockaddr *saddr, uint32_t name) {
+  if (pc->slotlen >= PING_ADDRREF_INET6) {
+    errno = E2BIG;
+    return -1;
+  }
+  if (pc->slotlen >= pc->slotcap) {
+    size_t cap = pc->slotcap * 2;
+    struct ping_slot *slot;
+    uint32_t *ref, *nameof;
+
+    if ((slot = realloc(pc->slot, cap * sizeof(*slot))) == NULL)
+      return -1;
+    memset(slot + pc->slotcap, 0, (cap - pc->slotcap) * sizeof(*slot));
+    pc->slot = slot;
+    if ((ref = realloc(pc->addrtab.ref, cap * sizeof(*ref))) == NULL)
+      return -1;
+    pc->addrtab.ref = ref;
+    if (pc->nameof != NULL) {
+      if ((nameof = realloc(pc->nameof, cap * sizeof(*nameof))) == NULL)
+        return -1;
+      pc->nameof = nameof;
+    }
+    pc->slotcap = cap;
+  }
+  if (ping_addrtab_add(&pc->addrtab, pc->slotlen, saddr) == -1)
+    return -1;
+  if (pc->nameof != NULL)
+    pc->nameof[pc->slotlen] = name;
+  pc->slotlen++;
+  pc->nonce_mod = UINT32_MAX / pc->slotlen;
+  return 0;
 }
 
 #if 0
@@ -431,6 +1837,7 @@ timespec_add (struct timespec a, struct timespec b)
 }
 #endif
 
+#if 0
 static struct timespec timespec_sub(struct timespec a, struct timespec b) {
   struct timespec c;
 
@@ -442,6 +1849,7 @@ static struct timespec timespec_sub(struct timespec a, struct timespec b) {
   c.tv_nsec = a.tv_nsec - b.tv_nsec;
   return c;
 }
+#endif
 
 #if 0
 static int
@@ -453,50 +1861,202 @@ timespec_cmp (struct timespec a, struct timespec b)
 }
 #endif
 
-static struct timespec timespec_zero() {
-  struct timespec ret = {0, 0};
-  return ret;
+static void ping_showrecv_print(struct ping_context *pc, size_t idx,
+                                const char *saddr_name) {
+  struct ping_slot *ps = pc->slot + idx;
+  uint64_t rtt = ps->state == PING_SLOT_RECV ? ps->time_ns : 0;
+
+  if (pc->mon != NULL) {
+    printf("%s %s %lu.%06lu", saddr_name,
+           ping_mon_event_name[pc->mon[idx].event],
+           (unsigned long)(rtt / 1000000000),
+           (unsigned long)(rtt % 1000000000 / 1000));
+    pc->mon[idx].event = PING_MON_EV_NONE;
+  } else if (pc->pmtu != NULL)
+    printf("%s %u", saddr_name, ps->count_recv ? pc->pmtu[idx].lo : 0);
+  else
+    printf("%s %lu.%06lu %d", saddr_name, (unsigned long)(rtt / 1000000000),
+           (unsigned long)(rtt % 1000000000 / 1000), ps->count_recv);
+  // 送信元の指定があれば送信元を付加する
+  if (pc->opt.nsrc > 0)
+    printf(" %s", ping_source_of(pc, idx)->name);
+  printf("\n");
+  if (!ps->printed) {
+    ps->printed = 1;
+    pc->nprinted++;
+  }
 }
 
-static void ping_showrecv_prepare(struct ping_context *pc, int idx,
-                                  int numeric) {
-  struct ping_info *pi = pc->info + idx;
+static void ping_showrecv_prepare(struct ping_context *pc, size_t idx,
+                                  const struct ping_addr *saddr, int numeric) {
+  asyncns_query_t *query;
   int flags = 0;
 
   if (numeric)
     flags |= NI_NUMERICHOST;
-  if ((pi->asyncns_name_query =
-           asyncns_getnameinfo(pc->asyncns, &pi->saddr_recv.addr,
-                               pi->saddr_recv.addrlen, flags, 1, 0)) == NULL)
+  if ((query = asyncns_getnameinfo(pc->asyncns, &saddr->addr, saddr->addrlen,
+                                   flags, 1, 0)) == NULL) {
     syslog(LOG_CRIT, "asyncns_getnameinfo: %s", strerror(errno));
+    ping_showrecv_print(pc, idx, "???");
+    return;
+  }
+  asyncns_setuserdata(pc->asyncns, query, (void *)(uintptr_t)idx);
 }
 
-static void ping_showrecv_done(struct ping_context *pc, int idx) {
-  struct ping_info *pi = pc->info + idx;
-  struct timespec rtt =
-      (pi->time_recv.tv_sec == 0 && pi->time_recv.tv_nsec == 0)
-          ? timespec_zero()
-          : timespec_sub(pi->time_recv, pi->time_sent);
+static void ping_showrecv_done(struct ping_context *pc,
+                               asyncns_query_t *query) {
+  size_t idx = (uintptr_t)asyncns_getuserdata(pc->asyncns, query);
   char saddr_name[NI_MAXHOST];
 
-  if (pi->asyncns_name_query == NULL)
+  int err = asyncns_getnameinfo_done(pc->asyncns, query, saddr_name,
+                                     sizeof(saddr_name), NULL, 0);
+  if (err == EAI_AGAIN)
+    return;
+  if (err != 0) {
+    syslog(LOG_WARNING, "asyncns_getnameinfo_done: %s\n", gai_strerror(err));
     strcpy(saddr_name, "???");
-  else {
-    int err = asyncns_getnameinfo_done(pc->asyncns, pi->asyncns_name_query,
-                                       saddr_name, sizeof(saddr_name), NULL, 0);
-    if (err == EAI_AGAIN)
-      return;
-    if (err != 0) {
-      syslog(LOG_WARNING, "asyncns_getnameinfo_done: %s\n", gai_strerror(err));
-      strcpy(saddr_name, "???");
+  }
+  ping_showrecv_print(pc, idx, saddr_name);
+}
+
+// 結果を共有メモリのリングに書き込む
+// 名前解決も書式化もしない
+static void ping_ring_put(struct ping_context *pc, size_t idx,
+                          const struct ping_addr *saddr) {
+  struct ping_slot *ps = pc->slot + idx;
+  struct mping_ring_record rec;
+  struct timespec now;
+
+  memset(&rec, 0, sizeof(rec));
+  clock_gettime(CLOCK_REALTIME, &now);
+  rec.time_ns = timespec_to_ns(now);
+  rec.target = pc->nameof != NULL ? pc->nameof[idx] : idx;
+  rec.round = pc->round;
+  rec.family = saddr->addr.sa_family;
+  if (ps->state == PING_SLOT_RECV) {
+    rec.state = MPING_RING_RECV;
+    rec.rtt_ns = ps->time_ns;
+  } else
+    rec.state = MPING_RING_TIMEOUT;
+  rec.count = ps->count_recv;
+  if (pc->mon != NULL) {
+    rec.event = pc->mon[idx].event;
+    pc->mon[idx].event = PING_MON_EV_NONE;
+  }
+  if (pc->pmtu != NULL && ps->count_recv)
+    rec.mtu = pc->pmtu[idx].lo;
+  if (saddr->addr.sa_family == AF_INET)
+    memcpy(rec.addr, &saddr->addr4.sin_addr, sizeof(struct in_addr));
+  else
+    memcpy(rec.addr, &saddr->addr6.sin6_addr, sizeof(struct in6_addr));
+  rec.src = pc->srcof != NULL ? pc->srcof[idx] : 0;
+  mping_ring_publish(pc->ring, &rec);
+  if (!ps->printed) {
+    ps->printed = 1;
+    pc->nprinted++;
+  }
+}
+
+// 結果の出力 (-R があれば共有メモリへ)
+static void ping_showrecv_result(struct ping_context *pc, size_t idx,
+                                 const struct ping_addr *saddr) {
+  if (pc->ring != NULL)
+    ping_ring_put(pc, idx, saddr);
+  else if (pc->nameof != NULL) {
+    // -F: 指定された名前とアドレスを並べる (逆引きはしない)
+    char addr[NI_MAXHOST], name[2 * NI_MAXHOST];
+
+    if (getnameinfo(&saddr->addr, saddr->addrlen, addr, sizeof(addr), NULL, 0,
+                    NI_NUMERICHOST) != 0)
+      strcpy(addr, "???");
+    snprintf(name, sizeof(name), "%s %s", pc->names[pc->nameof[idx]], addr);
+    ping_showrecv_print(pc, idx, name);
+  } else
+    ping_showrecv_prepare(pc, idx, saddr, pc->opt.numeric_print);
+}
+
+// 次の周回のための初期化
+static void ping_slot_round(struct ping_context *ctx) {
+  for (size_t idx = 0; idx < ctx->slotlen; idx++) {
+    struct ping_slot *ps = ctx->slot + idx;
+
+    ps->nonce = (ps->nonce + 1) % ctx->nonce_mod;
+    ps->state = PING_SLOT_IDLE;
+    ps->count_recv = 0;
+    ps->printed = 0;
+  }
+  ctx->sndidx = 0;
+  ctx->nprinted = 0;
+  ctx->round++;
+}
+
+static int ping_last_round(const struct ping_context *ctx) {
+  return ctx->opt.count != 0 && ctx->round + 1 >= ctx->opt.count;
+}
+
+static uint8_t ping_mon_band(const struct ping_option *po, uint64_t rtt) {
+  if (po->rtt_low_ns != 0 && rtt < po->rtt_low_ns)
+    return PING_MON_LOW;
+  if (po->rtt_high_ns != 0 && rtt > po->rtt_high_ns)
+    return PING_MON_HIGH;
+  return PING_MON_NORMAL;
+}
+
+// 周回の結果から状態を更新し, 変化した宛先だけを出力する
+// 停止は misses 回連続の無応答, 復旧は応答 1 回で判定する
+static void ping_mon_round(struct ping_context *ctx) {
+  size_t nup = 0, ndown = 0;
+
+  for (size_t idx = 0; idx < ctx->slotlen; idx++) {
+    struct ping_slot *ps = ctx->slot + idx;
+    struct ping_mon *pm = ctx->mon + idx;
+    uint8_t event = PING_MON_EV_NONE;
+
+    if (ps->state == PING_SLOT_RECV) {
+      uint8_t band = ping_mon_band(&ctx->opt, ps->time_ns);
+
+      pm->misses = 0;
+      // up の周回では帯域を normal のままにし, 帯域外なら次の周回で報告する
+      // (出力は名前解決の後なので 1 周回に 1 事象まで)
+      if (pm->state != PING_MON_UP) {
+        pm->state = PING_MON_UP;
+        pm->band = PING_MON_NORMAL;
+        event = PING_MON_EV_UP;
+      } else if (pm->band != band) {
+        pm->band = band;
+        event = PING_MON_EV_NORMAL + band;
+      }
+    } else {
+      ps->state = PING_SLOT_TIMEOUT;
+      if (pm->misses < UINT8_MAX)
+        pm->misses++;
+      if (pm->state != PING_MON_DOWN && pm->misses >= ctx->opt.misses) {
+        pm->state = PING_MON_DOWN;
+        pm->band = PING_MON_NORMAL;
+        event = PING_MON_EV_DOWN;
+      }
+    }
+    if (pm->state == PING_MON_UP)
+      nup++;
+    else if (pm->state == PING_MON_DOWN)
+      ndown++;
+
+    if (event != PING_MON_EV_NONE) {
+      struct ping_addr daddr;
+
+      pm->event = event;
+      ping_addrtab_get(&ctx->addrtab, idx, &daddr);
+      ping_showrecv_result(ctx, idx, &daddr);
     }
   }
+  if (ctx->opt.heartbeat != 0 && (ctx->round + 1) % ctx->opt.heartbeat == 0)
+    printf("# round %lu up %zu down %zu unknown %zu\n", ctx->round + 1, nup,
+           ndown, ctx->slotlen - nup - ndown);
+}
 
-  pi->asyncns_name_query = NULL;
-  printf("%s %ld.%06ld %d\n", saddr_name, rtt.tv_sec, rtt.tv_nsec / 1000,
-         pi->count_recv);
-  if (pi->count_recv == 0)
-    pi->count_recv = 1;
+static int ping_mon_new(struct ping_context *ctx) {
+  ctx->mon = calloc(ctx->slotlen ? ctx->slotlen : 1, sizeof(*ctx->mon));
+  return ctx->mon == NULL ? -1 : 0;
 }
 
 static void print_version(FILE *fp, int argc, char *argv[]) {
@@ -515,6 +2075,25 @@ static void print_usage(FILE *fp, int argc, char *argv[]) {
   fprintf(fp, "  -s size     : payload data size\n");
   fprintf(fp, "  -d data     : payload data\n");
   fprintf(fp, "  -t ttl      : set ip time to live\n");
+  fprintf(fp, "  -A          : adaptive send rate (start from 1/interval)\n");
+  fprintf(fp, "  -r rate     : max send rate for -A [pps]\n");
+  fprintf(fp, "  -p rate     : max send rate per prefix for -A [pps]\n");
+  fprintf(fp, "  -T          : trace route up to ttl hops (numeric output)\n");
+  fprintf(fp, "  -M          : discover path mtu\n");
+  fprintf(fp, "  -c count    : number of rounds (0: forever)\n");
+  fprintf(fp, "  -P period   : period between rounds\n");
+  fprintf(fp, "  -C          : print state changes only (imply -c 0)\n");
+  fprintf(fp, "  -K misses   : consecutive misses to report down for -C\n");
+  fprintf(fp, "  -b [low,]high : rtt band to report for -C\n");
+  fprintf(fp, "  -B rounds   : heartbeat every rounds for -C (0: none)\n");
+  fprintf(fp, "  -R file     : write results to shared memory ring file\n");
+  fprintf(fp, "  -Q records  : ring capacity for -R\n");
+  fprintf(fp, "  -L cpu      : precision mode pinned to cpu (busy polling)\n");
+  fprintf(fp, "  -I iface    : send from interface (repeatable)\n");
+  fprintf(fp, "  -S addr,... : send from source addresses (repeatable)\n");
+  fprintf(fp, "  -H          : assign sources by hash of destination\n");
+  fprintf(fp, "  -F all      : probe all addresses of each name\n");
+  fprintf(fp, "  -F family   : probe one address per family of each name\n");
   fprintf(fp, "  -n          : printing by numeric host\n");
   fprintf(fp, "  -N          : don't resolve hostname\n");
   fprintf(fp, "  -4          : ipv4 only\n");
@@ -547,9 +2126,33 @@ static void setloglevel(int level) {
   }
 }
 
-static int get_addr(const char *node, struct sockaddr *saddr,
-                    socklen_t *saddrlen, int ipv4, int ipv6, int numeric) {
+// 既に登録した宛先 idx と同じアドレスか (-F family では同じファミリか)
+static int ping_addrtab_match(const struct ping_addrtab *at, size_t idx,
+                              const struct sockaddr *saddr, int fanout) {
+  uint32_t ref = at->ref[idx];
+
+  if (ref & PING_ADDRREF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)saddr;
+    const struct ping_addr6 *addr6 = at->addr6 + (ref & ~PING_ADDRREF_INET6);
+
+    return saddr->sa_family == AF_INET6 &&
+           (fanout == PING_FANOUT_FAMILY ||
+            (memcmp(&addr6->addr, &sin6->sin6_addr, sizeof(addr6->addr)) ==
+                 0 &&
+             addr6->scope_id == sin6->sin6_scope_id));
+  }
+  return saddr->sa_family == AF_INET &&
+         (fanout == PING_FANOUT_FAMILY ||
+          at->addr4[ref].s_addr ==
+              ((const struct sockaddr_in *)saddr)->sin_addr.s_addr);
+}
+
+// 名前を解決して宛先表に追加する
+// fanout に従って最初の 1 つ, 全て, またはファミリ毎に 1 つを追加する
+static int get_addrs(struct ping_context *pc, const char *node, uint32_t name,
+                     int fanout, int ipv4, int ipv6, int numeric) {
   struct addrinfo *addrinfo, hints, *ai;
+  size_t first = pc->slotlen;
   int err;
 
   memset(&hints, 0, sizeof(hints));
@@ -568,13 +2171,23 @@ static int get_addr(const char *node, struct sockaddr *saddr,
     errno = 0;
     return -1;
   }
-  ai = addrinfo;
-  if (*saddrlen >= ai->ai_addrlen) {
-    memcpy(saddr, ai->ai_addr, ai->ai_addrlen);
-    *saddrlen = ai->ai_addrlen;
-  } else {
-    errno = ENOSPC;
-    return -1;
+  for (ai = addrinfo; ai != NULL; ai = ai->ai_next) {
+    size_t i;
+
+    // 同じアドレス (-F family では同じファミリ) は追加しない
+    for (i = first; i < pc->slotlen; i++)
+      if (ping_addrtab_match(&pc->addrtab, i, ai->ai_addr, fanout))
+        break;
+    if (i < pc->slotlen)
+      continue;
+    if (ping_context_add(pc, ai->ai_addr, name) == -1) {
+      int _errno = errno;
+      freeaddrinfo(addrinfo);
+      errno = _errno;
+      return -1;
+    }
+    if (fanout == PING_FANOUT_NONE)
+      break;
   }
   freeaddrinfo(addrinfo);
   return 0;
@@ -588,6 +2201,210 @@ static struct timespec dtots(double d) {
   return ts;
 }
 
+// 現在の送信率で送信間隔を再設定する
+static int ping_adapt_arm(struct ping_context *ctx) {
+  struct itimerspec it_in;
+
+  it_in.it_interval = dtots(1 / ctx->adapt->rate.rate);
+  it_in.it_value = it_in.it_interval;
+  if (timerfd_settime(ctx->intervalfd, 0, &it_in, NULL) == -1)
+    return -1;
+  syslog(LOG_DEBUG, "rate: %.1f pps", ctx->adapt->rate.rate);
+  ctx->adapt->armed_rate = ctx->adapt->rate.rate;
+  return 0;
+}
+
+// 応答の受信
+static int ping_recv(struct ping_context *ctx, int srcidx, int family) {
+  struct ping_reply reply;
+  ssize_t idx;
+
+  if ((family == AF_INET ? icmp4_recv(ctx->src[srcidx].sock4, srcidx, &reply)
+                         : icmp6_recv(ctx->src[srcidx].sock6, srcidx,
+                                      &reply)) == -1 ||
+      (idx = ping_reply_match(ctx, &reply)) == -1) {
+    if (errno == EAGAIN)
+      return 0;
+    syslog(LOG_CRIT, "icmp_echoreply_recv: %s", strerror(errno));
+    return -1;
+  }
+  // -F では周回の終わりに名前毎にまとめて出力する
+  if (ctx->trace == NULL && ctx->pmtu == NULL && ctx->mon == NULL &&
+      ctx->nameof == NULL)
+    ping_showrecv_result(ctx, idx, &reply.saddr);
+  return 0;
+}
+
+static int ping_calib_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// 計測の下限の較正 (-L)
+// ループバックとの往復時間を本番と同じ送受信の方法で測って表示する
+// 送信元 (-I, -S) に束縛されていない専用のソケットを使う
+// 本番の符号化の範囲外の tag (nonce == nonce_mod) を使い, 復号では必ず弾かれる
+// 応答を待ってから次を送り, 応答がなければ打ち切るので tag は 1 つでよい
+// 較正できなくても計測は続ける
+static void ping_calibrate(struct ping_context *ctx, int family) {
+  const char *name = family == AF_INET ? "ipv4" : "ipv6";
+  struct ping_addr daddr;
+  struct timespec now;
+  uint64_t *rtt = NULL, deadline;
+  uint32_t tag = ping_tag_encode(ctx, 0, ctx->nonce_mod);
+  size_t n = 0;
+  int sock;
+
+  memset(&daddr, 0, sizeof(daddr));
+  if (family == AF_INET) {
+    daddr.addr4.sin_family = AF_INET;
+    daddr.addr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    daddr.addrlen = sizeof(daddr.addr4);
+    sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+  } else {
+    daddr.addr6.sin6_family = AF_INET6;
+    daddr.addr6.sin6_addr = in6addr_loopback;
+    daddr.addrlen = sizeof(daddr.addr6);
+    sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+  }
+  if (sock == -1 ||
+      icmp_setopt(&ctx->opt, family == AF_INET ? sock : -1,
+                  family == AF_INET6 ? sock : -1) == -1 ||
+      (rtt = malloc(PING_CALIB_COUNT * sizeof(*rtt))) == NULL) {
+    printf("# calibration %s unavailable: %s\n", name, strerror(errno));
+    goto out;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  deadline = timespec_to_ns(now) + PING_CALIB_DEADLINE_NS;
+  for (int i = 0; i < PING_CALIB_COUNT; i++) {
+    union ping_echo_hdr hdr;
+    struct iovec iov[2];
+    uint64_t time_sent;
+    int timeout = 0;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = ctx->opt.data;
+    iov[1].iov_len = ctx->opt.datalen;
+    icmp_echo_header(family, tag, iov, 2);
+    if (icmp_sendmsg(sock, &daddr, iov, 2, 0, &time_sent) == -1) {
+      printf("# calibration %s unavailable: %s\n", name, strerror(errno));
+      goto out;
+    }
+    for (;;) {
+      struct ping_reply reply;
+
+      if ((family == AF_INET ? icmp4_recv(sock, 0, &reply)
+                             : icmp6_recv(sock, 0, &reply)) == 0 &&
+          reply.kind == PING_REPLY_ECHO && reply.tag == tag) {
+        rtt[n++] = reply.time_ns - time_sent;
+        break;
+      }
+      clock_gettime(CLOCK_REALTIME, &now);
+      if (timespec_to_ns(now) - time_sent > PING_CALIB_TIMEOUT_NS) {
+        timeout = 1;
+        break;
+      }
+    }
+    // 一度でも応答がなければ, または全体の期限を過ぎたら打ち切る
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (timeout || timespec_to_ns(now) > deadline)
+      break;
+  }
+
+  if (n == 0)
+    printf("# calibration %s unavailable: no reply\n", name);
+  else {
+    qsort(rtt, n, sizeof(*rtt), ping_calib_cmp);
+    printf("# calibration %s n %zu min %lu.%09lu median %lu.%09lu\n", name, n,
+           (unsigned long)(rtt[0] / 1000000000),
+           (unsigned long)(rtt[0] % 1000000000),
+           (unsigned long)(rtt[n / 2] / 1000000000),
+           (unsigned long)(rtt[n / 2] % 1000000000));
+  }
+out:
+  fflush(stdout);
+  free(rtt);
+  if (sock != -1)
+    close(sock);
+  // 本番のソケットにも届いた較正の応答を捨てる
+  for (int i = 0; i < ctx->nsrc; i++) {
+    int s = family == AF_INET ? ctx->src[i].sock4 : ctx->src[i].sock6;
+    char buf[1];
+
+    if (s != -1)
+      while (recv(s, buf, sizeof(buf), MSG_DONTWAIT) != -1)
+        ;
+  }
+}
+
+// 次の周回の開始
+static int ping_round_start(struct ping_context *ctx, struct timespec delay) {
+  struct itimerspec it_in;
+
+  if (ctx->intervalfd == -1 &&
+      (ctx->intervalfd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1)
+    return -1;
+  if (ctx->timeoutfd == -1 &&
+      (ctx->timeoutfd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1)
+    return -1;
+  it_in.it_value = delay;
+  it_in.it_interval = ctx->opt.interval;
+  return timerfd_settime(ctx->intervalfd, 0, &it_in, NULL);
+}
+
+// 前の周回の開始から period 後に次の周回を開始する
+static int ping_round_next(struct ping_context *ctx) {
+  struct timespec now;
+  uint64_t elapsed, period = timespec_to_ns(ctx->opt.period);
+
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    return -1;
+  elapsed = timespec_to_ns(now) - ctx->round_start_ns;
+  ctx->round_pending = 1;
+  if (elapsed >= period)
+    return ping_round_start(ctx, ntots(0, 1));
+  return ping_round_start(ctx, ntots((period - elapsed) / 1000000000,
+                                     (period - elapsed) % 1000000000));
+}
+
+// 送信の完了判定
+static int ping_send_done(struct ping_context *ctx) {
+  int ttl;
+
+  if (ctx->adapt != NULL)
+    return ping_adapt_done(ctx->adapt);
+  if (ctx->trace != NULL)
+    return ping_trace_next(ctx, &ttl) == -1;
+  if (ctx->pmtu != NULL)
+    return ping_pmtu_next(ctx) == -1;
+  return ctx->sndidx >= ctx->slotlen;
+}
+
+// 次の要求の送信 (1: 送信した, 0: 送信可能な宛先がない, -1: エラー)
+static int ping_send_next(struct ping_context *ctx, uint64_t now) {
+  ssize_t idx;
+
+  if (ctx->adapt != NULL) {
+    if ((idx = ping_adapt_next(ctx->adapt, now)) == -1)
+      return 0;
+    if (ping_slot_send(ctx, idx) == -1)
+      return -1;
+    ping_adapt_sent(ctx, idx);
+    return 1;
+  }
+  if (ctx->trace != NULL)
+    return ping_trace_send(ctx) == -1 ? -1 : 1;
+  if (ctx->pmtu != NULL)
+    return ping_pmtu_send(ctx) == -1 ? -1 : 1;
+  if (ping_slot_send(ctx, ctx->sndidx) == -1)
+    return -1;
+  ctx->sndidx++;
+  return 1;
+}
+
 int main(int argc, char *argv[]) {
   struct ping_context ctx;
   struct ping_option ctx_opt = po_defaults();
@@ -595,9 +2412,12 @@ int main(int argc, char *argv[]) {
   int opt;
   long opt_long;
   double opt_double;
+  int count_set = 0;
   char *p;
 
-  while ((opt = getopt(argc, argv, "w:i:s:d:t:neN46vVh")) != -1) {
+  while ((opt = getopt(argc, argv,
+                       "w:i:s:d:t:r:p:I:S:c:P:K:b:B:R:Q:L:F:ATMHCneN46vVh")) !=
+         -1) {
     switch (opt) {
     case 'w':
       opt_double = strtod(optarg, &p);
@@ -650,6 +2470,138 @@ int main(int argc, char *argv[]) {
       ctx_opt.ttl = opt_long;
       break;
 
+    case 'A':
+      ctx_opt.adaptive = 1;
+      break;
+
+    case 'T':
+      ctx_opt.trace = 1;
+      break;
+
+    case 'M':
+      ctx_opt.pmtu = 1;
+      break;
+
+    case 'I':
+    case 'S':
+      for (p = strtok(optarg, ","); p != NULL; p = strtok(NULL, ",")) {
+        if (ctx_opt.nsrc >= PING_SOURCE_MAX) {
+          fprintf(stderr, "too many sources (max %d)\n", PING_SOURCE_MAX);
+          exit(EXIT_FAILURE);
+        }
+        ctx_opt.src[ctx_opt.nsrc].type =
+            opt == 'I' ? PING_SOURCE_IFACE : PING_SOURCE_ADDR;
+        ctx_opt.src[ctx_opt.nsrc].name = p;
+        ctx_opt.nsrc++;
+      }
+      break;
+
+    case 'H':
+      ctx_opt.srchash = 1;
+      break;
+
+    case 'c':
+    case 'B':
+      opt_long = strtol(optarg, &p, 0);
+      if (p == optarg || *p != '\0' || opt_long < 0) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (opt == 'c') {
+        ctx_opt.count = opt_long;
+        count_set = 1;
+      } else
+        ctx_opt.heartbeat = opt_long;
+      break;
+
+    case 'P':
+      opt_double = strtod(optarg, &p);
+      if (p == optarg || *p != '\0' || opt_double < 0) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      ctx_opt.period = dtots(opt_double);
+      break;
+
+    case 'K':
+      opt_long = strtol(optarg, &p, 0);
+      if (p == optarg || *p != '\0' || opt_long < 1 || opt_long > UINT8_MAX) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      ctx_opt.misses = opt_long;
+      break;
+
+    case 'b': {
+      double low = 0, high;
+
+      // "high" または "low,high"
+      high = strtod(optarg, &p);
+      if (p != optarg && *p == ',') {
+        low = high;
+        high = strtod(p + 1, &p);
+      }
+      if (p == optarg || *p != '\0' || low < 0 || high < low) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      ctx_opt.rtt_low_ns = timespec_to_ns(dtots(low));
+      ctx_opt.rtt_high_ns = timespec_to_ns(dtots(high));
+      break;
+    }
+
+    case 'C':
+      ctx_opt.changes = 1;
+      break;
+
+    case 'R':
+      ctx_opt.ring_path = optarg;
+      break;
+
+    case 'F':
+      if (strcmp(optarg, "all") == 0)
+        ctx_opt.fanout = PING_FANOUT_ALL;
+      else if (strcmp(optarg, "family") == 0)
+        ctx_opt.fanout = PING_FANOUT_FAMILY;
+      else {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'L':
+      opt_long = strtol(optarg, &p, 0);
+      if (p == optarg || *p != '\0' || opt_long < 0 ||
+          opt_long >= CPU_SETSIZE) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      ctx_opt.cpu = opt_long;
+      ctx_opt.precision = 1;
+      break;
+
+    case 'Q':
+      opt_long = strtol(optarg, &p, 0);
+      if (p == optarg || *p != '\0' || opt_long < 1 || opt_long > 1L << 31) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      ctx_opt.ring_capacity = opt_long;
+      break;
+
+    case 'r':
+    case 'p':
+      opt_double = strtod(optarg, &p);
+      if (p == optarg || *p != '\0' || opt_double < PING_ADAPT_RATE_MIN) {
+        fprintf(stderr, "rate must be at least %g\n", PING_ADAPT_RATE_MIN);
+        exit(EXIT_FAILURE);
+      }
+      if (opt == 'r')
+        ctx_opt.rate = opt_double;
+      else
+        ctx_opt.prefix_rate = opt_double;
+      break;
+
     case 'n':
       ctx_opt.numeric_print = 1;
       break;
@@ -703,6 +2655,34 @@ int main(int argc, char *argv[]) {
     ctx_opt.ipv4 = 1;
     ctx_opt.ipv6 = 1;
   }
+  if (ctx_opt.adaptive + ctx_opt.trace + ctx_opt.pmtu > 1) {
+    fprintf(stderr, "-A, -T and -M cannot be used together\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ctx_opt.changes && !count_set)
+    ctx_opt.count = 0;
+  if ((ctx_opt.changes || ctx_opt.count != 1) &&
+      (ctx_opt.adaptive || ctx_opt.trace || ctx_opt.pmtu)) {
+    fprintf(stderr, "-c and -C cannot be used with -A, -T nor -M\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ctx_opt.precision &&
+      (ctx_opt.adaptive || ctx_opt.trace || ctx_opt.pmtu)) {
+    fprintf(stderr, "-L cannot be used with -A, -T nor -M\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ctx_opt.ring_path != NULL && ctx_opt.trace) {
+    fprintf(stderr, "-R cannot be used with -T\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ctx_opt.pmtu) {
+    // 全ての大きさで共有するペイロード
+    if (ctx_opt.data != NULL) {
+      fprintf(stderr, "-d cannot be used with -M\n");
+      exit(EXIT_FAILURE);
+    }
+    ctx_opt.datalen = MAX_DATALEN4;
+  }
   if (ctx_opt.data == NULL) {
     ctx_opt.data = malloc(ctx_opt.datalen);
     if (ctx_opt.data == NULL) {
@@ -717,29 +2697,95 @@ int main(int argc, char *argv[]) {
     syslog(LOG_CRIT, "ping_context_new: %s", strerror(errno));
     exit(EXIT_FAILURE);
   }
-  ctx.infolen = argc - optind;
-  ctx.info = alloca(sizeof(*ctx.info) * ctx.infolen);
-  memset(ctx.info, 0, sizeof(*ctx.info) * ctx.infolen);
 
-  for (int i = 0; i < ctx.infolen; i++) {
-    struct ping_info *pi = ctx.info + i;
+  if (ping_context_alloc(&ctx, argc - optind) == -1) {
+    syslog(LOG_CRIT, "ping_context_alloc: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  ctx.names = argv + optind;
 
-    pi->daddr_send.addrlen = sizeof(pi->daddr_send);
-    if (get_addr(argv[optind + i], &pi->daddr_send.addr,
-                 &pi->daddr_send.addrlen, ctx.opt.ipv4, ctx.opt.ipv6,
-                 ctx.opt.numeric_parse) == -1) {
+  // 宛先の名前解決 (-F では名前を複数のアドレスに展開する)
+  for (int i = 0; i < argc - optind; i++)
+    if (get_addrs(&ctx, argv[optind + i], i, ctx.opt.fanout, ctx.opt.ipv4,
+                  ctx.opt.ipv6, ctx.opt.numeric_parse) == -1) {
       if (errno)
         syslog(LOG_CRIT, "%s: %s", argv[optind + i], strerror(errno));
       exit(EXIT_FAILURE);
     }
+
+  if (ping_source_assign(&ctx) == -1) {
+    syslog(LOG_CRIT, "ping_source_assign: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (ctx.opt.adaptive && ping_adapt_new(&ctx) == -1) {
+    syslog(LOG_CRIT, "ping_adapt_new: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (ctx.opt.trace && ping_trace_new(&ctx) == -1) {
+    syslog(LOG_CRIT, "ping_trace_new: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (ctx.opt.pmtu && ping_pmtu_new(&ctx) == -1) {
+    syslog(LOG_CRIT, "ping_pmtu_new: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (!ctx.opt.trace && !ctx.opt.pmtu && ping_tmpl_new(&ctx) == -1) {
+    syslog(LOG_CRIT, "ping_tmpl_new: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (ctx.opt.changes && ping_mon_new(&ctx) == -1) {
+    syslog(LOG_CRIT, "ping_mon_new: %s", strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (ctx.opt.ring_path != NULL) {
+    if ((ctx.ring = malloc(sizeof(*ctx.ring))) == NULL) {
+      syslog(LOG_CRIT, "malloc: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (mping_ring_create(ctx.ring, ctx.opt.ring_path,
+                          ctx.opt.ring_capacity) == -1) {
+      syslog(LOG_CRIT, "%s: %s", ctx.opt.ring_path, strerror(errno));
+      free(ctx.ring);
+      ctx.ring = NULL;
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (ctx.opt.precision) {
+    cpu_set_t cpus;
+
+    // 計測を行うスレッドを固定する
+    CPU_ZERO(&cpus);
+    CPU_SET(ctx.opt.cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+      syslog(LOG_CRIT, "sched_setaffinity: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+      syslog(LOG_WARNING, "mlockall: %s", strerror(errno));
+    // 宛先のあるアドレスファミリだけを較正する
+    if (ctx.addrtab.addr4len > 0)
+      ping_calibrate(&ctx, AF_INET);
+    if (ctx.addrtab.addr6len > 0)
+      ping_calibrate(&ctx, AF_INET6);
   }
 
   do {
     struct itimerspec it_in;
+    struct timespec start;
 
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1) {
+      syslog(LOG_CRIT, "clock_gettime: %s", strerror(errno));
+      exitcode = EXIT_FAILURE;
+      break;
+    }
+    ctx.round_start_ns = timespec_to_ns(start);
     it_in.it_value.tv_sec = 0;
     it_in.it_value.tv_nsec = 1;
     it_in.it_interval = ctx.opt.interval;
+    if (ctx.adapt != NULL) {
+      it_in.it_interval = dtots(1 / ctx.adapt->rate.rate);
+      ctx.adapt->armed_rate = ctx.adapt->rate.rate;
+    }
 
     if (timerfd_settime(ctx.intervalfd, 0, &it_in, NULL) == -1) {
       syslog(LOG_CRIT, "timerfd_settime: %s", strerror(errno));
@@ -750,14 +2796,21 @@ int main(int argc, char *argv[]) {
     do {
       int nfds = -1;
       fd_set rfds;
+      struct timeval spin = {0, 0};
 
       FD_ZERO(&rfds);
-      FD_SET(ctx.sock4, &rfds);
-      if (nfds < ctx.sock4)
-        nfds = ctx.sock4;
-      FD_SET(ctx.sock6, &rfds);
-      if (nfds < ctx.sock6)
-        nfds = ctx.sock6;
+      for (int i = 0; i < ctx.nsrc; i++) {
+        if (ctx.src[i].sock4 != -1) {
+          FD_SET(ctx.src[i].sock4, &rfds);
+          if (nfds < ctx.src[i].sock4)
+            nfds = ctx.src[i].sock4;
+        }
+        if (ctx.src[i].sock6 != -1) {
+          FD_SET(ctx.src[i].sock6, &rfds);
+          if (nfds < ctx.src[i].sock6)
+            nfds = ctx.src[i].sock6;
+        }
+      }
       if (asyncns_getnqueries(ctx.asyncns) > 0) {
         FD_SET(ctx.asyncnsfd, &rfds);
         if (nfds < ctx.asyncnsfd)
@@ -774,7 +2827,9 @@ int main(int argc, char *argv[]) {
           nfds = ctx.intervalfd;
       }
 
-      int ret = select(nfds + 1, &rfds, NULL, NULL, NULL);
+      // -L では待たずに回り続ける
+      int ret = select(nfds + 1, &rfds, NULL, NULL,
+                       ctx.opt.precision ? &spin : NULL);
       if (ret == -1) {
         syslog(LOG_CRIT, "select: %s", strerror(errno));
         exitcode = EXIT_FAILURE;
@@ -788,11 +2843,7 @@ int main(int argc, char *argv[]) {
           asyncns_query_t *query;
 
           while ((query = asyncns_getnext(ctx.asyncns)) != NULL)
-            for (int i = 0; i < ctx.sndidx; i++)
-              if (query == ctx.info[i].asyncns_name_query) {
-                ping_showrecv_done(&ctx, i);
-                break;
-              }
+            ping_showrecv_done(&ctx, query);
         }
       }
       if (ctx.intervalfd != -1 && FD_ISSET(ctx.intervalfd, &rfds)) {
@@ -808,8 +2859,31 @@ int main(int argc, char *argv[]) {
           exitcode = EXIT_FAILURE;
           break;
         }
+        if (ctx.round_pending) {
+          struct timespec start;
+
+          // 前の周回の出力が終わるまで次の周回を待たせる
+          if (asyncns_getnqueries(ctx.asyncns) > 0)
+            continue;
+          if (clock_gettime(CLOCK_MONOTONIC, &start) == -1) {
+            syslog(LOG_CRIT, "clock_gettime: %s", strerror(errno));
+            exitcode = EXIT_FAILURE;
+            break;
+          }
+          ctx.round_start_ns = timespec_to_ns(start);
+          ctx.round_pending = 0;
+          ping_slot_round(&ctx);
+        }
+        struct timespec now;
+        if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+          syslog(LOG_CRIT, "clock_gettime: %s", strerror(errno));
+          exitcode = EXIT_FAILURE;
+          break;
+        }
+        if (ctx.adapt != NULL)
+          ping_adapt_expire(&ctx, timespec_to_ns(now));
         for (int i = 0; i < count; i++) {
-          if (ctx.sndidx >= ctx.infolen) {
+          if (ping_send_done(&ctx)) {
             struct itimerspec it_to;
 
             close(ctx.intervalfd);
@@ -826,60 +2900,87 @@ int main(int argc, char *argv[]) {
             break;
           }
 
-          if (icmp_echo_send(&ctx) == -1) {
+          int ret = ping_send_next(&ctx, timespec_to_ns(now));
+          if (ret == -1) {
             syslog(LOG_CRIT, "icmp_echo_send: %s", strerror(errno));
             exitcode = EXIT_FAILURE;
             break;
           }
+          if (ret == 0)
+            break;
+        }
+        if (exitcode == EXIT_SUCCESS && ping_batch_flush(&ctx) == -1) {
+          syslog(LOG_CRIT, "sendmmsg: %s", strerror(errno));
+          exitcode = EXIT_FAILURE;
         }
         if (exitcode != EXIT_SUCCESS)
           break;
+
+        // 送信率が変化したら送信間隔を再設定する
+        if (ctx.adapt != NULL && ctx.intervalfd != -1 &&
+            (ctx.adapt->rate.rate > ctx.adapt->armed_rate * 1.1 ||
+             ctx.adapt->rate.rate < ctx.adapt->armed_rate * 0.9)) {
+          if (ping_adapt_arm(&ctx) == -1) {
+            syslog(LOG_CRIT, "timerfd_settime: %s", strerror(errno));
+            exitcode = EXIT_FAILURE;
+            break;
+          }
+        }
       }
 
       if (ctx.timeoutfd != -1 && FD_ISSET(ctx.timeoutfd, &rfds)) {
-        for (int i = 0; i < ctx.infolen; i++)
-          if (ctx.info[i].count_recv == 0) {
-            memcpy(&ctx.info[i].saddr_recv, &ctx.info[i].daddr_send,
-                   sizeof(ctx.info[i].saddr_recv));
-            ping_showrecv_prepare(&ctx, i, ctx.opt.numeric_print);
-          }
         close(ctx.timeoutfd);
         ctx.timeoutfd = -1;
-      }
-
-      if (FD_ISSET(ctx.sock4, &rfds)) {
-        int idx = icmp4_echoreply_recv(&ctx);
-        if (idx == -1) {
-          if (errno == EAGAIN)
-            goto next;
-          syslog(LOG_CRIT, "icmp_echoreply_recv: %s", strerror(errno));
-          break;
+        if (ctx.trace != NULL)
+          ping_trace_print(&ctx);
+        else if (ctx.pmtu != NULL && ping_pmtu_round(&ctx) > 0) {
+          if (ping_round_start(&ctx, ntots(0, 1)) == -1) {
+            syslog(LOG_CRIT, "ping_round_start: %s", strerror(errno));
+            exitcode = EXIT_FAILURE;
+            break;
+          }
+        } else {
+          if (ctx.mon != NULL)
+            ping_mon_round(&ctx);
+          else
+            for (size_t i = 0; i < ctx.slotlen; i++)
+              if (ctx.slot[i].count_recv == 0 || ctx.pmtu != NULL ||
+                  ctx.nameof != NULL) {
+                struct ping_addr daddr;
+
+                if (ctx.slot[i].count_recv == 0)
+                  ctx.slot[i].state = PING_SLOT_TIMEOUT;
+                ping_addrtab_get(&ctx.addrtab, i, &daddr);
+                ping_showrecv_result(&ctx, i, &daddr);
+              }
+          if (!ping_last_round(&ctx)) {
+            if (ping_round_next(&ctx) == -1) {
+              syslog(LOG_CRIT, "ping_round_next: %s", strerror(errno));
+              exitcode = EXIT_FAILURE;
+              break;
+            }
+          } else if (ctx.mon != NULL)
+            // 変化のない宛先は出力しない
+            ctx.nprinted = ctx.slotlen;
         }
-        ctx.info[idx].count_recv++;
-        ping_showrecv_prepare(&ctx, idx, ctx.opt.numeric_print);
+        fflush(stdout);
       }
 
-      if (FD_ISSET(ctx.sock6, &rfds)) {
-        int idx = icmp6_echoreply_recv(&ctx);
-        if (idx == -1) {
-          if (errno == EAGAIN)
-            goto next;
-          syslog(LOG_CRIT, "icmp_echoreply_recv: %s", strerror(errno));
+      int i;
+      for (i = 0; i < ctx.nsrc; i++) {
+        if (ctx.src[i].sock4 != -1 && FD_ISSET(ctx.src[i].sock4, &rfds) &&
+            ping_recv(&ctx, i, AF_INET) == -1)
+          break;
+        if (ctx.src[i].sock6 != -1 && FD_ISSET(ctx.src[i].sock6, &rfds) &&
+            ping_recv(&ctx, i, AF_INET6) == -1)
           break;
-        }
-        ctx.info[idx].count_recv++;
-        ping_showrecv_prepare(&ctx, idx, ctx.opt.numeric_print);
       }
+      if (i < ctx.nsrc)
+        break;
 
-    next: {
-      int count_recvs = 0;
-      for (int i = 0; i < ctx.infolen; i++)
-        if (ctx.info[i].asyncns_name_query == NULL &&
-            ctx.info[i].count_recv > 0)
-          count_recvs++;
-      if (count_recvs >= ctx.infolen)
+      if (ping_last_round(&ctx) && !ctx.round_pending &&
+          ctx.nprinted >= ctx.slotlen && asyncns_getnqueries(ctx.asyncns) == 0)
         break;
-    }
     } while (1);
   } while (0);
   ping_context_destory(&ctx);
@@ -0,0 +1,233 @@
+#if HAS_CONFIG_H
+#include "config.h"
+#else
+#define _GNU_SOURCE
+#define PACKAGE_STRING "mping"
+#define PACKAGE_BUGREPORT "sombody@example.com"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+
+#include "mping_ring.h"
+
+#define POLL_INTERVAL_NS 1000000
+
+static const char *const event_name[] = {
+    "-", "up", "down", "rtt-normal", "rtt-low", "rtt-high",
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_record(const struct mping_ring_record *rec) {
+  char addr[INET6_ADDRSTRLEN];
+
+  if (inet_ntop(rec->family, rec->addr, addr, sizeof(addr)) == NULL)
+    strcpy(addr, "???");
+  printf("%lu %lu %u %s %s %lu.%06lu %u %u %s %u\n", (unsigned long)rec->seq,
+         (unsigned long)rec->round, rec->target, addr,
+         rec->state == MPING_RING_RECV ? "recv" : "timeout",
+         (unsigned long)(rec->rtt_ns / 1000000000),
+         (unsigned long)(rec->rtt_ns % 1000000000 / 1000), rec->count,
+         rec->mtu,
+         rec->event < sizeof(event_name) / sizeof(event_name[0])
+             ? event_name[rec->event]
+             : "?",
+         rec->src);
+}
+
+// 記録を読み出して表示する
+// follow が真なら書き込み側が終了するまで待つ
+static int dump(const char *path, int follow) {
+  struct mping_ring ring;
+  struct mping_ring_record rec;
+  struct timespec wait = {0, POLL_INTERVAL_NS};
+
+  if (mping_ring_open(&ring, path) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  for (;;) {
+    if (mping_ring_read(&ring, &rec)) {
+      print_record(&rec);
+      continue;
+    }
+    if (!follow || mping_ring_closed(&ring)) {
+      // 終了通知の後に書かれた分を読み切る
+      if (mping_ring_read(&ring, &rec)) {
+        print_record(&rec);
+        continue;
+      }
+      break;
+    }
+    fflush(stdout);
+    nanosleep(&wait, NULL);
+  }
+  if (ring.lost > 0)
+    fprintf(stderr, "%lu records lost\n", (unsigned long)ring.lost);
+  mping_ring_close(&ring, 0);
+  return 0;
+}
+
+// 書き込み側と読み出し側を別プロセスで動かして処理量を測る
+static int bench(const char *path, unsigned long count, uint32_t capacity) {
+  struct mping_ring ring, reader;
+  struct mping_ring_record rec;
+  unsigned long nread = 0;
+  uint64_t start, elapsed;
+  pid_t pid;
+  int status;
+
+  if (mping_ring_create(&ring, path, capacity) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  // 書き込みのみ
+  memset(&rec, 0, sizeof(rec));
+  rec.family = AF_INET;
+  rec.state = MPING_RING_RECV;
+  start = now_ns();
+  for (unsigned long i = 0; i < count; i++) {
+    rec.target = i;
+    rec.rtt_ns = i;
+    mping_ring_publish(&ring, &rec);
+  }
+  elapsed = now_ns() - start;
+  printf("publish: %lu records in %.6f s (%.2f Mrecords/s)\n", count,
+         elapsed / 1e9, count / (elapsed / 1e3));
+  mping_ring_close(&ring, 1);
+
+  // 書き込みと読み出しを並行して
+  if (mping_ring_create(&ring, path, capacity) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (mping_ring_open(&reader, path) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    mping_ring_close(&ring, 1);
+    unlink(path);
+    return -1;
+  }
+  fflush(stdout);
+  if ((pid = fork()) == -1) {
+    fprintf(stderr, "fork: %s\n", strerror(errno));
+    mping_ring_close(&reader, 0);
+    mping_ring_close(&ring, 1);
+    unlink(path);
+    return -1;
+  }
+  if (pid == 0) {
+    for (unsigned long i = 0; i < count; i++) {
+      rec.target = i;
+      rec.rtt_ns = i;
+      mping_ring_publish(&ring, &rec);
+    }
+    mping_ring_close(&ring, 1);
+    _exit(EXIT_SUCCESS);
+  }
+  start = now_ns();
+  for (;;) {
+    // 終了通知を先に見てから読むので, 通知前に書かれた分は読み切れる
+    int closed = mping_ring_closed(&reader);
+
+    if (mping_ring_read(&reader, &rec))
+      nread++;
+    else if (closed)
+      break;
+  }
+  elapsed = now_ns() - start;
+  waitpid(pid, &status, 0);
+  // 取りこぼした分は処理量に含めない
+  printf("consume: %lu records in %.6f s (%.2f Mrecords/s)\n", nread,
+         elapsed / 1e9, nread / (elapsed / 1e3));
+  printf("lost: %lu records (%.2f%%)\n", (unsigned long)reader.lost,
+         count ? 100.0 * reader.lost / count : 0.0);
+  mping_ring_close(&reader, 0);
+  mping_ring_close(&ring, 0);
+  unlink(path);
+  return 0;
+}
+
+static void print_usage(FILE *fp, int argc, char *argv[]) {
+  fprintf(fp, "Usage:\n");
+  fprintf(fp, "  %s [options] file\n", argv[0]);
+  fprintf(fp, "\n");
+  fprintf(fp, "Read results written by mping -R file.\n");
+  fprintf(fp, "Output: seq round target addr state rtt count mtu event src\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "Options:\n");
+  fprintf(fp, "  -f          : follow until mping exits\n");
+  fprintf(fp, "  -b count    : benchmark with count records on file\n");
+  fprintf(fp, "  -Q records  : ring capacity for -b\n");
+  fprintf(fp, "  -V          : print version\n");
+  fprintf(fp, "  -h          : print usage\n");
+  fprintf(fp, "\n");
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long count = 0;
+  uint32_t capacity = MPING_RING_CAPACITY_DEFAULT;
+  int follow = 0;
+  int opt;
+  long opt_long;
+  char *p;
+
+  while ((opt = getopt(argc, argv, "b:Q:fVh")) != -1) {
+    switch (opt) {
+    case 'f':
+      follow = 1;
+      break;
+
+    case 'b':
+    case 'Q':
+      opt_long = strtol(optarg, &p, 0);
+      if (p == optarg || *p != '\0' || opt_long < 1 ||
+          (opt == 'Q' && opt_long > 1L << 31)) {
+        fprintf(stderr, "error argument -%c %s\n", opt, optarg);
+        exit(EXIT_FAILURE);
+      }
+      if (opt == 'b')
+        count = opt_long;
+      else
+        capacity = opt_long;
+      break;
+
+    case 'V':
+      printf("%s\n", PACKAGE_STRING);
+      exit(EXIT_SUCCESS);
+
+    case 'h':
+      printf("%s\n", PACKAGE_STRING);
+      print_usage(stdout, argc, argv);
+      exit(EXIT_SUCCESS);
+
+    default:
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind + 1 != argc) {
+    print_usage(stderr, argc, argv);
+    exit(EXIT_FAILURE);
+  }
+  if (count > 0)
+    return bench(argv[optind], count, capacity) == -1 ? EXIT_FAILURE
+                                                      : EXIT_SUCCESS;
+  return dump(argv[optind], follow) == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,249 @@
+#ifndef MPING_RING_H
+#define MPING_RING_H
+
+// mping の結果を共有メモリ上のリングバッファで受け渡す (mping -R)
+//
+// ファイル (例: /dev/shm/mping) の配置:
+//
+//   offset 0           : struct mping_ring_header (64 byte)
+//   offset header_size : struct mping_ring_record (64 byte) x capacity
+//
+// - 書き込みは mping の 1 プロセスのみ (single producer)
+// - 通番 seq のレコードは records[seq & (capacity - 1)] に置かれる
+// - header.head は次に書き込む通番 (head 未満が書き込み済み)
+// - 書き込み中のレコードの seq は MPING_RING_SEQ_BUSY になる
+// - 読み出し側はレコードを複写した後に seq を再確認し,
+//   一致しなければ上書きされた (取りこぼした) と判断する
+// - head - capacity より古い通番は既に上書きされている
+// - ファイルは一時ファイルに作成してから rename するので,
+//   読み出し中のファイルが切り詰められることはない
+// - mping が終了すると header.closed が 1 になる
+//
+// 値は全てホストのバイトオーダ
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MPING_RING_MAGIC 0x474e4952474e504dULL // "MPNGRING"
+#define MPING_RING_VERSION 1
+#define MPING_RING_SEQ_BUSY UINT64_MAX
+#define MPING_RING_CAPACITY_DEFAULT 65536
+
+// レコードの状態
+enum mping_ring_state {
+  MPING_RING_RECV = 1, // 応答あり
+  MPING_RING_TIMEOUT,  // 応答なし
+};
+
+struct mping_ring_header {
+  uint64_t magic;       // MPING_RING_MAGIC
+  uint32_t version;     // MPING_RING_VERSION
+  uint32_t header_size; // レコード領域の先頭 offset
+  uint32_t record_size; // sizeof(struct mping_ring_record)
+  uint32_t capacity;    // レコード数 (2 のべき乗)
+  uint64_t head;        // 次に書き込む通番
+  uint32_t pid;         // 書き込み側のプロセス ID
+  uint32_t closed;      // 書き込み側が終了した
+  uint8_t reserved[24];
+};
+
+struct mping_ring_record {
+  uint64_t seq;      // 通番 (書き込み中は MPING_RING_SEQ_BUSY)
+  uint64_t time_ns;  // 結果を確定した時刻 (CLOCK_REALTIME)
+  uint64_t rtt_ns;   // 往復時間 (応答なしは 0)
+  uint32_t target;   // 宛先の番号 (コマンドライン上の順序, 0 起点)
+                     // -F では同じ名前のアドレスが同じ番号になる
+  uint32_t round;    // 周回の番号 (-c, 0 起点)
+  uint16_t family;   // AF_INET / AF_INET6
+  uint8_t state;     // enum mping_ring_state
+  uint8_t event;     // -C の事象 (up=1, down, rtt-normal, rtt-low, rtt-high)
+  uint16_t count;    // 受信数
+  uint16_t mtu;      // -M の経路 MTU
+  uint8_t addr[16];  // 応答元アドレス (IPv4 は先頭 4 byte)
+  uint8_t src;       // 送信元の番号 (-S/-I)
+  uint8_t reserved[7];
+};
+
+// 書き込み側・読み出し側で共通のマッピング
+struct mping_ring {
+  struct mping_ring_header *hdr;
+  struct mping_ring_record *rec;
+  size_t size;
+  uint64_t next;    // 書き込み側: 次の通番, 読み出し側: 次に読む通番
+  uint64_t lost;    // 読み出し側: 取りこぼしたレコード数
+};
+
+// リングを作成する (書き込み側)
+// capacity は 2 のべき乗に切り上げる
+static inline int mping_ring_create(struct mping_ring *r, const char *path,
+                                    uint32_t capacity) {
+  struct mping_ring_header *hdr;
+  char *tmp;
+  int fd, _errno;
+  uint32_t cap = 1;
+
+  while (cap < capacity && cap < (UINT32_C(1) << 31))
+    cap <<= 1;
+  r->size = sizeof(*hdr) + (size_t)cap * sizeof(struct mping_ring_record);
+  if ((tmp = malloc(strlen(path) + 8)) == NULL)
+    return -1;
+  sprintf(tmp, "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) == -1) {
+    _errno = errno;
+    free(tmp);
+    errno = _errno;
+    return -1;
+  }
+  if (fchmod(fd, 0644) == -1 || ftruncate(fd, r->size) == -1 ||
+      (hdr = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+    _errno = errno;
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    errno = _errno;
+    return -1;
+  }
+  close(fd);
+  hdr->version = MPING_RING_VERSION;
+  hdr->header_size = sizeof(*hdr);
+  hdr->record_size = sizeof(struct mping_ring_record);
+  hdr->capacity = cap;
+  hdr->head = 0;
+  hdr->pid = getpid();
+  hdr->closed = 0;
+  __atomic_store_n(&hdr->magic, MPING_RING_MAGIC, __ATOMIC_RELEASE);
+  if (rename(tmp, path) == -1) {
+    _errno = errno;
+    munmap(hdr, r->size);
+    unlink(tmp);
+    free(tmp);
+    errno = _errno;
+    return -1;
+  }
+  free(tmp);
+  r->hdr = hdr;
+  r->rec = (struct mping_ring_record *)((char *)hdr + sizeof(*hdr));
+  r->next = 0;
+  r->lost = 0;
+  return 0;
+}
+
+// レコードを書き込む (書き込み側)
+// rec->seq は無視して通番を振る
+static inline void mping_ring_publish(struct mping_ring *r,
+                                      const struct mping_ring_record *rec) {
+  uint64_t seq = r->next++;
+  struct mping_ring_record *dst = r->rec + (seq & (r->hdr->capacity - 1));
+
+  __atomic_store_n(&dst->seq, MPING_RING_SEQ_BUSY, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)dst + sizeof(dst->seq), (const char *)rec + sizeof(rec->seq),
+         sizeof(*rec) - sizeof(rec->seq));
+  __atomic_store_n(&dst->seq, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->hdr->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+// リングを開く (読み出し側)
+// 最も古い残っているレコードから読み出す
+static inline int mping_ring_open(struct mping_ring *r, const char *path) {
+  struct mping_ring_header *hdr;
+  struct stat st;
+  uint64_t head;
+  int fd, _errno;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return -1;
+  if (fstat(fd, &st) == -1) {
+    _errno = errno;
+    close(fd);
+    errno = _errno;
+    return -1;
+  }
+  if (st.st_size < (off_t)sizeof(*hdr)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  _errno = errno;
+  close(fd);
+  if (hdr == MAP_FAILED) {
+    errno = _errno;
+    return -1;
+  }
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MPING_RING_MAGIC ||
+      hdr->version != MPING_RING_VERSION ||
+      hdr->record_size != sizeof(struct mping_ring_record) ||
+      hdr->capacity == 0 || (hdr->capacity & (hdr->capacity - 1)) != 0 ||
+      hdr->header_size + (uint64_t)hdr->capacity * hdr->record_size >
+          (uint64_t)st.st_size) {
+    munmap(hdr, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  r->hdr = hdr;
+  r->rec = (struct mping_ring_record *)((char *)hdr + hdr->header_size);
+  r->size = st.st_size;
+  // 開く前に上書きされた分は取りこぼしに数えない
+  head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  r->next = head > hdr->capacity ? head - hdr->capacity : 0;
+  r->lost = 0;
+  return 0;
+}
+
+// レコードを 1 件読み出す (読み出し側)
+// 戻り値: 1 読み出した, 0 新しいレコードがない
+// 上書きされて読めなかったレコードは r->lost に数える
+static inline int mping_ring_read(struct mping_ring *r,
+                                  struct mping_ring_record *rec) {
+  uint64_t cap = r->hdr->capacity;
+
+  for (;;) {
+    uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    const struct mping_ring_record *src;
+
+    if (r->next >= head)
+      return 0;
+    if (head - r->next > cap) {
+      r->lost += head - cap - r->next;
+      r->next = head - cap;
+    }
+    src = r->rec + (r->next & (cap - 1));
+    if (__atomic_load_n(&src->seq, __ATOMIC_ACQUIRE) == r->next) {
+      memcpy(rec, src, sizeof(*rec));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == r->next) {
+        rec->seq = r->next++;
+        return 1;
+      }
+    }
+    // 読み出し中に上書きされた
+    r->lost++;
+    r->next++;
+  }
+}
+
+// 書き込み側が終了したか
+static inline int mping_ring_closed(const struct mping_ring *r) {
+  return __atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE) != 0;
+}
+
+// 書き込み側は終了を通知してから閉じる
+static inline void mping_ring_close(struct mping_ring *r, int producer) {
+  if (producer)
+    __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+  munmap(r->hdr, r->size);
+  r->hdr = NULL;
+  r->rec = NULL;
+}
+
+#endif